@@ -2,9 +2,16 @@
 // Created by nudelerde on 16.12.22.
 //
 
+#pragma once
+
 #include "RSDP.h"
+#include "test/test.h"
 #include "util/time.h"
 
+namespace proc {
+struct thread;
+}
+
 namespace APIC {
 
 struct MADT : public ACPI::SDP{
@@ -60,11 +67,39 @@ struct LocalAPIC {
     inline uint32_t get_id() { return lapic_id() >> 24; }
 };
 
+struct timer_data {
+    uint64_t ticks_needed;
+    uint64_t prev_init;
+    void (*callback)(void*);
+    void* data;
+};
+
+struct CPU_Core;
+
+/**
+* data that only its own core uses, the gs base of every core points to its block, so each field is a single %gs: load
+* every block gets a page of its own, so the cores don't write into the same cache lines
+*/
+struct alignas(64) CPU_Local {
+    CPU_Local* self;// first, gs:0 is the address of the block
+    CPU_Core* core;
+    uint64_t os_id;
+    proc::thread* current_thread;
+    // where the kernel continues when the current thread leaves
+    uint64_t kernel_stack_ptr;
+    uint64_t kernel_code_ptr;
+    timer_data timer;
+    bool in_page_fault;// a fault while the page fault handler runs on this core cannot be resolved
+};
+static_assert(sizeof(CPU_Local) % 64 == 0, "CPU_Local has to fill whole cache lines");
+
 struct CPU_Core {
     LocalAPIC local_apic;
+    CPU_Local* local{};
     uint64_t os_id{};
     uint8_t acpi_id{};
     uint8_t apic_id{};
+    volatile bool online{};
 };
 
 struct IOAPIC {
@@ -76,9 +111,44 @@ struct IOAPIC {
     static void interrupt_set_mask(uint8_t io_vector, bool mask);
 };
 
+/**
+* points the gs base at an empty block, so the per cpu accessors work before the cores are known, the kernel calls it first
+*/
+void init_cpu_local();
+
+// nullptr until the block of this core is set up
+inline CPU_Local* get_cpu_local() {
+    CPU_Local* local;
+    asm volatile("mov %%gs:0, %0"
+                 : "=r"(local));
+    return local;
+}
+
+// 0 on the boot processor before the cores are known
+inline uint64_t get_cpu_number() {
+    uint64_t os_id;
+    asm volatile("mov %%gs:%c1, %0"
+                 : "=r"(os_id)
+                 : "i"(__builtin_offsetof(CPU_Local, os_id)));
+    return os_id;
+}
+
 void initLocalAPIC();
+// nullptr until the block of this core is set up
 CPU_Core* get_current_cpu();
 LocalAPIC get_current_lapic();
 size_t get_core_count();
+size_t get_online_core_count();
+/**
+* runs job on every online core and returns once all of them finished, the boot processor calls it and runs its share itself
+* the application processors run it from their idle loop, so it waits until they are idle
+*/
+void run_on_all_cores(void (*job)(void*), void* data);
+/**
+* invalidates the tlb entries of size bytes starting at start in the given address space on all other online cores and waits until they are done
+*/
+void shootdown_tlb(PhysicalAddress space, VirtualAddress start, uint64_t size);
+
+Test::Result test();
 
 }
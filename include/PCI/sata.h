@@ -165,6 +165,7 @@ struct Sata {
         static_assert(sizeof(command_tables) == (page_count_per_port - 1) * page_size);
 
     private:
+        // ports are set up on the stack and copied, the lock is named once the port reached its device
         spinlock lock;
         [[nodiscard]] optional<uint8_t> find_free_slot() const;
         result<uint64_t, error_t> setup_physical_region(uint64_t slot, VirtualAddress buffer, size_t size);
@@ -183,6 +184,8 @@ struct Sata {
 
         volatile uint8_t* mmio{};
         void init();
+        // the port stays at its address for as long as the kernel runs, so its lock can show up in the lock statistics
+        void name_lock() { lock.set_name("sata port"); }
         volatile command_list* command_list_ptr{};
         volatile received_fis* received_fis_ptr{};
         volatile command_tables* command_table_ptr{};
@@ -74,14 +74,15 @@ inline void setFlags(uint64_t flags) {
                  : "r"(flags));
 }
 
+// rdmsr and wrmsr split the value into edx:eax
 inline uint64_t getMSR(uint64_t msr) {
-    uint64_t value;
+    uint32_t low, high;
     asm volatile(R"(
         rdmsr
         )"
-                 : "=a"(value)
+                 : "=a"(low), "=d"(high)
                  : "c"(msr));
-    return value;
+    return ((uint64_t) high << 32) | low;
 }
 
 inline void setMSR(uint64_t msr, uint64_t value) {
@@ -89,7 +90,7 @@ inline void setMSR(uint64_t msr, uint64_t value) {
         wrmsr
         )"
                  :
-                 : "c"(msr), "a"(value));
+                 : "c"(msr), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
 }
 
 inline uint64_t getEFER() {
@@ -256,6 +257,24 @@ inline void cpuid(uint32_t in, uint32_t* out_a, uint32_t* out_b, uint32_t* out_c
                  : "a"(in));
 }
 
+inline void cpuid(uint32_t in, uint32_t sub, uint32_t* out_a, uint32_t* out_b, uint32_t* out_c, uint32_t* out_d) {
+    uint32_t unused;
+    if (!out_a) out_a = &unused;
+    if (!out_b) out_b = &unused;
+    if (!out_c) out_c = &unused;
+    if (!out_d) out_d = &unused;
+    asm volatile("cpuid"
+                 : "=a"(*out_a), "=b"(*out_b), "=c"(*out_c), "=d"(*out_d)
+                 : "a"(in), "c"(sub));
+}
+
+inline uint64_t rdtsc() {
+    uint32_t low, high;
+    asm volatile("rdtsc"
+                 : "=a"(low), "=d"(high));
+    return (uint64_t) high << 32 | low;
+}
+
 inline uint64_t getRAX() {
     uint64_t rax;
     asm volatile("mov %%rax, %0"
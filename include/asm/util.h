@@ -14,9 +14,33 @@ inline void sti() {
     asm("sti");
 }
 
-inline void flush_cache() {
-    asm("wbinvd");
-    asm("invd");
-    auto cr3 = getCR3();
-    setCR3(cr3);
+inline void invlpg(void* address) {
+    asm volatile("invlpg (%0)"
+                 :
+                 : "r"(address)
+                 : "memory");
+}
+
+// type 0: one address of a pcid, 1: all entries of a pcid, 2: everything including global entries, 3: everything but global entries
+inline void invpcid(uint64_t type, uint64_t pcid, uint64_t address) {
+    struct {
+        uint64_t pcid;
+        uint64_t address;
+    } descriptor{pcid, address};
+    asm volatile("invpcid %0, %1"
+                 :
+                 : "m"(descriptor), "r"(type)
+                 : "memory");
+}
+
+inline void clflush(volatile void* address) {
+    asm volatile("clflush (%0)"
+                 :
+                 : "r"(address)
+                 : "memory");
+}
+
+inline void memory_barrier() {
+    asm volatile("mfence" ::
+                         : "memory");
 }
\ No newline at end of file
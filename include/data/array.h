@@ -6,19 +6,23 @@
 
 #include "features/smart_pointer.h"
 #include "int.h"
+#include "memory/heap.h"
 
-template<typename T>
+/**
+* @tparam allocator creates the zeroed storage with create_array, single_deleter uses the kernel heap and arena::allocator the arena of the cpu
+*/
+template<typename T, typename allocator = single_deleter>
 struct array {
 private:
-    unique_ptr<uint8_t> ptr;
+    unique_ptr<uint8_t, allocator> ptr;
 
 public:
     size_t count{};
     size_t element_size{};
 
     array() = default;
-    array(size_t count) : count(count), element_size(sizeof(T)), ptr(new uint8_t[element_size * count]) {}
-    array(size_t count, size_t element_size) : count(count), element_size(element_size), ptr(new uint8_t[element_size * count]) {}
+    array(size_t count) : ptr(allocator::template create_array<uint8_t>(sizeof(T) * count)), count(count), element_size(sizeof(T)) {}
+    array(size_t count, size_t element_size) : ptr(allocator::template create_array<uint8_t>(element_size * count)), count(count), element_size(element_size) {}
 
     T& operator[](size_t index) {
         return *reinterpret_cast<T*>(ptr.get() + index * element_size);
@@ -31,6 +35,25 @@ public:
         return ptr.get();
     }
 
+    /**
+    * changes the number of elements, the existing ones are kept and new ones are zeroed
+    * the storage only moves if the heap can not grow it in place, arena storage always moves
+    */
+    void resize(size_t new_count) {
+        uint8_t* storage;
+        if constexpr (std::is_same_v<allocator, single_deleter>) {
+            storage = static_cast<uint8_t*>(krealloc(ptr.release(), element_size * new_count));
+        } else {
+            storage = allocator::template create_array<uint8_t>(element_size * new_count);
+            memcpy(storage, ptr.get(), element_size * (count < new_count ? count : new_count));
+        }
+        if (new_count > count) {
+            memset(storage + element_size * count, 0, element_size * (new_count - count));
+        }
+        ptr.reset(storage);
+        count = new_count;
+    }
+
     struct iterator {
         uint8_t* data;
         size_t element_size;
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "features/optional.h"
+#include "features/smart_pointer.h"
 #include "memory/heap.h"
 #include "memory/mem.h"
 #include "test/test.h"
@@ -26,7 +27,10 @@ struct btree_node {
     }
 };
 
-template<typename T>
+/**
+* @tparam allocator creates and deletes the nodes, see linked_list
+*/
+template<typename T, typename allocator = single_deleter>
 struct btree {
     // 4096 = sizeof(size_t) + 2 * M * sizeof(void*) + (2 * M - 1) * sizeof(T);
     static constexpr size_t M = (4096 - sizeof(size_t) + sizeof(T)) / ((sizeof(void*) + sizeof(T)) * 2);
@@ -59,6 +63,24 @@ struct btree {
                 return Test::Result::failure("Found removed value");
             }
         }
+        // scattered order, so nodes split and merge in the middle of the tree
+        for (T i = 0; i < T(4096); ++i) {
+            tree.insert(i * T(1543) % T(4096));
+        }
+        for (T i = 0; i < T(4096); i += T(2)) {
+            if (!tree.remove(i * T(2731) % T(4096))) {
+                return Test::Result::failure("Could not remove value");
+            }
+        }
+        for (T i = 0; i < T(4096); ++i) {
+            bool removed = i % T(2) == 0;
+            if (bool(tree.find(i * T(2731) % T(4096))) == removed) {
+                return Test::Result::failure("Wrong value after scattered removal");
+            }
+        }
+        if (auto next = tree.lower_bound(T(4096) / T(2) + T(1)); !next || *next < T(4096) / T(2) + T(1)) {
+            return Test::Result::failure("lower_bound returned a smaller value");
+        }
         return Test::Result::success();
     }
 
@@ -70,7 +92,7 @@ struct btree {
     btree& operator=(const btree& other) = delete;
     btree(btree&& other) = delete;
     btree& operator=(btree&& other) = delete;
-    ~btree() { delete m_root; }
+    ~btree() { destroy_node(m_root); }
 
     /**
      * @brief Iterates over the tree in order and calls callable for each element, if callable returns false, iteration stops
@@ -95,6 +117,25 @@ struct btree {
         return {};
     }
 
+    /**
+     * @returns the smallest element that is not less than cmp
+     */
+    [[nodiscard]] optional<T> lower_bound(const T& cmp) const {
+        optional<T> result;
+        node* node = m_root;
+        while (node != nullptr) {
+            auto off = node->find_offset(cmp);
+            if (off < node->size) {
+                if (node->data[off] == cmp) {
+                    return node->data[off];
+                }
+                result = node->data[off];
+            }
+            node = node->children[off];
+        }
+        return result;
+    }
+
     bool remove(const T& cmp) {
         auto res = remove_impl(cmp);
         if (res) {
@@ -105,11 +146,11 @@ struct btree {
 
     void insert(const T& cmp) {
         if (m_root == nullptr) {
-            m_root = new node();
+            m_root = allocator::template create<node>();
             m_root->data[0] = cmp;
             m_root->size = 1;
         } else if (m_root->size == node::max_data_count) {
-            auto new_root = new node();
+            auto new_root = allocator::template create<node>();
             auto old_root = m_root;
             m_root = new_root;
             new_root->size = 0;
@@ -126,6 +167,16 @@ struct btree {
     [[nodiscard]] inline bool empty() const { return m_size == 0; }
 
 private:
+    void destroy_node(node* x) {
+        if (x == nullptr) return;
+        if (x->children[0] != nullptr) {
+            for (size_t i = 0; i <= x->size; ++i) {
+                destroy_node(x->children[i]);
+            }
+        }
+        allocator::do_delete(x);
+    }
+
     /**
      * @brief Iterates over the tree in order and calls callable for each element, if callable returns false, iteration stops
      * @tparam C Callable type (T -> bool)
@@ -159,7 +210,8 @@ private:
                 }
                 if (x->children[i]->size == node::max_data_count) {
                     split_child(x, i);
-                    if (x->data[i - 1] < cmp) {
+                    // the middle element of the child moved up to data[i]
+                    if (x->data[i] < cmp) {
                         i++;
                     }
                 }
@@ -170,7 +222,7 @@ private:
 
     void split_child(node* x, size_t i) {
         auto left = x->children[i];
-        auto right = new node();
+        auto right = allocator::template create<node>();
         right->size = M - 1;
         for (size_t j = 0; j < M - 1; j++) {
             right->data[j] = std::move(left->data[j + M]);
@@ -187,135 +239,81 @@ private:
             x->children[j + 1] = x->children[j];
         }
         x->children[i + 1] = right;
-        //for (int64_t j = x->size; j >= i; j--) {
-        //    x->data[j - 1] = std::move(y->data[j - 1]);
-        //}
+        for (size_t j = x->size; j > i; j--) {
+            x->data[j] = std::move(x->data[j - 1]);
+        }
         x->data[i] = std::move(left->data[M - 1]);
         left->data[M - 1] = {};
         x->size++;
     }
 
+    // single pass removal, every node the search descends into has at least M elements, so removing from it never underflows
     bool remove_impl(const T& cmp) {
         if (m_root == nullptr) {
             return false;
         }
-        node* p = m_root;
-        node* q = nullptr;
-        bool found = false;
-        if (p->children[0] == nullptr) {
-            for (size_t i = 0; i < p->size; ++i) {
-                if (p->data[i] == cmp) {
-                    if (p->size == 1) {
-                        delete m_root;
-                        m_root = nullptr;
-                    } else {
-                        for (size_t j = i; j < p->size - 1; ++j) {
-                            p->data[j] = std::move(p->data[j + 1]);
-                        }
-                        p->data[p->size - 1] = {};
-                        p->size--;
-                    }
-                    return true;
-                }
-            }
-            return false;
-        } else if (p->size == 1) {
-            if (p->children[0]->size == p->children[1]->size && p->children[1]->size == M - 1) {
-                p->data[M - 1] = std::move(p->data[0]);
-                node* p1 = p->children[0];
-                node* p2 = p->children[1];
-                p->children[0] = p1->children[0];
-                p->children[M] = p2->children[0];
-                for (size_t i = 0; i < M - 1; ++i) {
-                    p->data[i] = std::move(p1->data[i]);
-                    p->children[i + 1] = p1->children[i + 1];
-                    p->data[i + M] = std::move(p2->data[i]);
-                    p->children[i + M + 1] = p2->children[i + 1];
-                }
-                p->size = 2 * M - 1;
-                delete p1;
-                delete p2;
-            } else {
-                if (cmp <= p->data[0]) {
-                    if (p->children[0]->size == M - 1) {
-                        shift_key_to_sibling(p, 1, false);
-                    }
-                    if (p->data[0] == cmp) {
-                        q = p;
-                        found = true;
-                    }
-                    p = p->children[0];
-                } else {
-                    if (p->children[1]->size == M - 1) {
-                        shift_key_to_sibling(p, 1, true);
-                    }
-                    if (p->data[0] == cmp) {
-                        q = p;
-                        found = true;
-                    }
-                    p = p->children[1];
-                }
-            }
+        bool res = remove_from(m_root, cmp);
+        if (m_root->size == 0) {
+            // the root lost its last element, by a merge of its only two children or because it was the last leaf
+            node* old_root = m_root;
+            m_root = old_root->children[0];
+            old_root->children[0] = nullptr;
+            allocator::do_delete(old_root);
         }
+        return res;
+    }
 
+    bool remove_from(node* x, const T& cmp) {
+        T key = cmp;
         while (true) {
-            if (p->children[0] == nullptr) {
-                for (size_t i = 0; i < p->size; ++i) {
-                    if (p->data[i] == cmp) {
-                        for (size_t j = i; j < p->size - 1; ++j) {
-                            p->data[j] = std::move(p->data[j + 1]);
-                        }
-                        p->data[p->size - 1] = {};
-                        p->size--;
-                        return true;
+            size_t i = x->find_offset(key);
+            bool leaf = x->children[0] == nullptr;
+            if (i < x->size && x->data[i] == key) {
+                if (leaf) {
+                    for (size_t j = i; j < x->size - 1; ++j) {
+                        x->data[j] = std::move(x->data[j + 1]);
                     }
+                    x->data[x->size - 1] = {};
+                    x->size--;
+                    return true;
                 }
-                if (found) {
-                    for (size_t i = 0; i < q->size; ++i) {
-                        if (q->data[i] == cmp) {
-                            q->data[i] = p->data[p->size - 1];
-                            p->data[p->size - 1] = {};
-                            p->size--;
-                            return true;
-                        }
-                    }
+                node* left = x->children[i];
+                node* right = x->children[i + 1];
+                if (left->size >= M) {
+                    // replace the element with its predecessor and remove that from the left subtree
+                    node* last = left;
+                    while (last->children[0] != nullptr) last = last->children[last->size];
+                    key = last->data[last->size - 1];
+                    x->data[i] = key;
+                    x = left;
+                } else if (right->size >= M) {
+                    node* first = right;
+                    while (first->children[0] != nullptr) first = first->children[0];
+                    key = first->data[0];
+                    x->data[i] = key;
+                    x = right;
+                } else {
+                    merge_two_siblings(x, i + 1);
+                    x = left;
                 }
-                return false;
             } else {
-                size_t k;
-                for (k = 0; k < p->size; ++k) {
-                    if (cmp <= p->data[k]) {
-                        break;
-                    }
+                if (leaf) {
+                    return false;
                 }
-                if (p->children[k]->size == M - 1) {
-                    if (k == p->size) {
-                        if (p->children[k - 1]->size == M - 1) {
-                            merge_two_siblings(p, k - 1);
-                        } else {
-                            shift_key_to_sibling(p, k, true);
-                        }
+                node* child = x->children[i];
+                if (child->size == M - 1) {
+                    if (i > 0 && x->children[i - 1]->size >= M) {
+                        shift_key_to_sibling(x, i, true);
+                    } else if (i < x->size && x->children[i + 1]->size >= M) {
+                        shift_key_to_sibling(x, i + 1, false);
+                    } else if (i < x->size) {
+                        merge_two_siblings(x, i + 1);
                     } else {
-                        if (p->children[k + 1]->size == M - 1) {
-                            merge_two_siblings(p, k + 1);
-                        } else {
-                            shift_key_to_sibling(p, k + 1, false);
-                        }
-                    }
-                }
-                for (size_t i = 0; i < p->size; ++i) {
-                    if (p->data[i] == cmp) {
-                        found = true;
-                        q = p;
-                        break;
+                        child = x->children[i - 1];
+                        merge_two_siblings(x, i);
                     }
                 }
-                for (k = 0; k < p->size; ++k) {
-                    if (cmp <= p->data[k]) {
-                        break;
-                    }
-                }
-                p = p->children[k];
+                x = child;
             }
         }
     }
@@ -347,10 +345,10 @@ private:
             right->size--;
             if (left->children[0] != nullptr) {
                 left->children[left->size] = right->children[0];
-                for (size_t i = 0; i < right->size; ++i) {
+                for (size_t i = 0; i <= right->size; ++i) {
                     right->children[i] = right->children[i + 1];
                 }
-                right->children[right->size] = nullptr;
+                right->children[right->size + 1] = nullptr;
             }
         } else {
             // shift key from p[k-1] to p[k]
@@ -380,8 +378,8 @@ private:
                 for (size_t i = right->size; i > 0; --i) {
                     right->children[i] = right->children[i - 1];
                 }
-                right->children[0] = left->children[left->size];
-                left->children[left->size] = nullptr;
+                right->children[0] = left->children[left->size + 1];
+                left->children[left->size + 1] = nullptr;
             }
         }
     }
@@ -401,11 +399,10 @@ private:
             p->data[i] = std::move(p->data[i + 1]);
             p->children[i + 1] = p->children[i + 2];
         }
-        p->children[p->size] = p->children[p->size + 1];
         p->data[p->size - 1] = {};
         p->children[p->size] = nullptr;
         p->size--;
-        delete p2;
+        allocator::do_delete(p2);
     }
 };
 
@@ -425,17 +422,17 @@ struct pair {
 
 }// namespace btree_impl
 
-template<typename K, typename V>
-struct btree_map : public btree<btree_impl::pair<K,V>>{
+template<typename K, typename V, typename allocator = single_deleter>
+struct btree_map : public btree<btree_impl::pair<K,V>, allocator>{
     [[nodiscard]] optional<V> find(const K& cmp) const {
-        auto res = btree<btree_impl::pair<K,V>>::find(btree_impl::pair<K,V>{cmp, V{}});
+        auto res = btree<btree_impl::pair<K,V>, allocator>::find(btree_impl::pair<K,V>{cmp, V{}});
         if(!res) {
             return {};
         }
         return res->value;
     }
     void insert(const K& key, const V& value) {
-        btree<btree_impl::pair<K,V>>::insert(btree_impl::pair<K,V>{key, value});
+        btree<btree_impl::pair<K,V>, allocator>::insert(btree_impl::pair<K,V>{key, value});
     }
     /**
      * @brief Iterates over the tree in order and calls callable for each element, if callable returns false, iteration stops
@@ -444,11 +441,11 @@ struct btree_map : public btree<btree_impl::pair<K,V>>{
      */
     template<typename C>
     void iterate_kv(C callable) {
-        btree<btree_impl::pair<K,V>>::iterate([&callable](const btree_impl::pair<K,V>& p) -> bool{
+        btree<btree_impl::pair<K,V>, allocator>::iterate([&callable](const btree_impl::pair<K,V>& p) -> bool{
             return callable(p.key, p.value);
         });
     }
     bool remove(const K& key) {
-        return btree<btree_impl::pair<K,V>>::remove(btree_impl::pair<K,V>{key, V{}});
+        return btree<btree_impl::pair<K,V>, allocator>::remove(btree_impl::pair<K,V>{key, V{}});
     }
 };
\ No newline at end of file
@@ -5,9 +5,13 @@
 #pragma once
 
 #include "features/optional.h"
+#include "features/smart_pointer.h"
 #include "memory/heap.h"
 
-template<typename T>
+/**
+* @tparam allocator creates and deletes the nodes, single_deleter uses the kernel heap and cache_allocator a cache of the node type
+*/
+template<typename T, typename allocator = single_deleter>
 struct linked_list {
     struct node {
         T elem;
@@ -68,6 +72,8 @@ struct linked_list {
         other.size = 0;
     }
     linked_list& operator=(linked_list&& other) noexcept {
+        if (this == &other) return *this;
+        clear();
         first = other.first;
         last = other.last;
         size = other.size;
@@ -77,11 +83,7 @@ struct linked_list {
         return *this;
     }
     ~linked_list() {
-        while (first != nullptr) {
-            auto next = first->next;
-            delete first;
-            first = next;
-        }
+        clear();
     }
 
     optional<node*> find_node(size_t index) {
@@ -104,8 +106,20 @@ struct linked_list {
     }
 
     void push_back(const T& elem) {
-        auto node = new linked_list::node();
+        auto node = allocator::template create<linked_list::node>();
         node->elem = elem;
+        link_back(node);
+    }
+
+    // moves elem into the list, shared pointers keep their counts
+    void push_back(T&& elem) {
+        auto node = allocator::template create<linked_list::node>();
+        node->elem = std::move(elem);
+        link_back(node);
+    }
+
+private:
+    void link_back(node* node) {
         node->next = nullptr;
         node->prev = last;
         if (last != nullptr) {
@@ -118,13 +132,14 @@ struct linked_list {
         size++;
     }
 
+public:
     void pop_back() {
         remove(size - 1);
     }
 
     void remove(size_t index) {
         if (size == 1 && index == 0) {
-            delete first;
+            allocator::do_delete(first);
             first = nullptr;
             last = nullptr;
             size = 0;
@@ -141,14 +156,14 @@ struct linked_list {
         } else {
             last = node->prev;
         }
-        delete node;
+        allocator::do_delete(node);
         size--;
     }
 
     void clear() {
         while (first != nullptr) {
             auto next = first->next;
-            delete first;
+            allocator::do_delete(first);
             first = next;
         }
         last = nullptr;
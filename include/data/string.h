@@ -4,29 +4,56 @@
 
 #pragma once
 
+#include "features/optional.h"
 #include "features/string.h"
 #include "memory/mem.h"
 #include "int.h"
 
+// memory/heap.h includes the logger, which needs string
+namespace kheap {
+void* malloc(size_t size);
+void free(void* ptr);
+void* realloc(void* ptr, size_t size);
+optional<size_t> get_size(void* ptr);
+}// namespace kheap
+namespace arena {
+struct allocator;
+void* allocate(size_t size, size_t alignment);
+}// namespace arena
+
 struct string {
 private:
     bool owns_data = true;
 
+    // the buffer is always filled right away, so it skips the zeroing of new[]
+    static char* allocate(size_t size) {
+        return static_cast<char*>(kheap::malloc(size));
+    }
+
+    // bytes the heap handed out for data, at least length + 1 for strings that own their data
+    [[nodiscard]] size_t capacity() const {
+        if (!owns_data || data == nullptr) return 0;
+        return kheap::get_size(data).value_or(0);
+    }
+
+    string(char* data, size_t length, bool owns_data) : owns_data(owns_data), data(data), length(length) {}
+
 public:
     char* data;
     size_t length;
 
     constexpr string() : data(nullptr), length(0) {}
     constexpr string(const char* str) : data((char*) str), length(strlen(str)), owns_data(false) {}
-    string(const string& str) : data(new char[str.length]), length(str.length) {
+    string(const string& str) : data(allocate(str.length + 1)), length(str.length) {
         memcpy(data, str.data, length);
+        data[length] = '\0';
     }
     string(string&& str) noexcept {
         if (str.owns_data) {
             data = str.data;
             length = str.length;
         } else {
-            data = new char[str.length + 1];
+            data = allocate(str.length + 1);
             length = str.length;
             memcpy(data, str.data, length);
             data[length] = '\0';
@@ -36,37 +63,33 @@ public:
     }
     ~string() {
         if (owns_data)
-            delete[] data;
+            kheap::free(data);
     }
     string& operator=(const string& str) {
         if (this == &str)
             return *this;
-        if (owns_data) {
-            if (length < str.length) {
-                delete[] data;
-                data = new char[str.length + 1];
-                data[str.length] = '\0';
-            }
-        } else {
-            data = new char[str.length + 1];
-            data[str.length] = '\0';
+        // the old buffer is kept as long as the heap block behind it is large enough
+        if (capacity() < str.length + 1) {
+            if (owns_data) kheap::free(data);
+            data = allocate(str.length + 1);
             owns_data = true;
         }
         length = str.length;
         memcpy(data, str.data, length);
+        data[length] = '\0';
         return *this;
     }
     string& operator=(string&& str) noexcept {
         if (this == &str)
             return *this;
         if (owns_data) {
-            delete[] data;
+            kheap::free(data);
         }
         if (str.owns_data) {
             data = str.data;
             length = str.length;
         } else {
-            data = new char[str.length + 1];
+            data = allocate(str.length + 1);
             length = str.length;
             memcpy(data, str.data, length);
             data[length] = '\0';
@@ -112,22 +135,26 @@ public:
     string operator+(const string& str) const {
         string result;
         result.length = length + str.length;
-        result.data = new char[result.length + 1];
+        result.data = allocate(result.length + 1);
         memcpy(result.data, data, length);
         memcpy(result.data + length, str.data, str.length);
         result.data[result.length] = '\0';
         return result;
     }
     string& operator+=(const string& str) {
-        char* new_data = new char[length + str.length + 1];
-        memcpy(new_data, data, length);
-        memcpy(new_data + length, str.data, str.length);
-        new_data[length + str.length] = '\0';
-        if (owns_data)
-            delete[] data;
-        data = new_data;
+        bool self = str.data == data;
+        if (owns_data) {
+            // grows in place while the heap block has room
+            data = static_cast<char*>(kheap::realloc(data, length + str.length + 1));
+        } else {
+            char* new_data = allocate(length + str.length + 1);
+            memcpy(new_data, data, length);
+            data = new_data;
+            owns_data = true;
+        }
+        memcpy(data + length, self ? data : str.data, str.length);
         length += str.length;
-        owns_data = true;
+        data[length] = '\0';
         return *this;
     }
     static string from_char_array(const char* ptr, size_t size) {
@@ -139,9 +166,21 @@ public:
         }
         string result;
         result.length = size;
-        result.data = new char[size + 1];
+        result.data = allocate(size + 1);
         memcpy(result.data, ptr, size);
         result.data[size] = '\0';
         return result;
     }
+    /**
+    * copies the characters into the arena of the current cpu, the string is only valid until the enclosing arena::scope ends
+    * copies and moves of it go to the kernel heap, so it has to be constructed in place
+    */
+    static string from_char_array(const char* ptr, size_t size, const arena::allocator&) {
+        size_t length = 0;
+        while (length < size && ptr[length] != '\0') length++;
+        auto* data = static_cast<char*>(arena::allocate(length + 1, 1));
+        memcpy(data, ptr, length);
+        data[length] = '\0';
+        return string(data, length, false);
+    }
 };
\ No newline at end of file
@@ -6,15 +6,143 @@
 
 #include "int.h"
 
-struct spinlock {
+namespace Test {
+struct Result;
+}
+
+/**
+* counters of one lock instance, only collected in builds with LOCK_STATS_CRACKOS3 defined and empty otherwise
+* a named lock registers itself for locks::print_stats the first time it is taken and stays registered, so named locks need static storage duration
+* locks on the stack or in objects that are copied or freed stay unnamed and are not collected, all counters are written by the holder
+* the name is set by a constexpr constructor, so a struct holding a lock has to be constant initialized to keep it
+*/
+struct lock_stats {
+#ifdef LOCK_STATS_CRACKOS3
+    const char* name;
+    lock_stats* next_registered;
+    bool registered;
+    uint64_t acquisitions;
+    uint64_t contended;  // acquisitions that had to wait
+    uint64_t spin_cycles;// cycles spent waiting by all contended acquisitions
+    uint64_t max_hold;   // longest time in cycles between acquisition and release
+    uint64_t hold_start;
+
+    constexpr explicit lock_stats(const char* name = nullptr)
+        : name(name), next_registered(nullptr), registered(false), acquisitions(0), contended(0), spin_cycles(0), max_hold(0), hold_start(0) {}
+
+    // names a lock that could not be named at construction, before it is taken for the first time
+    // the lock is registered from then on, so it has to stay at its address until the kernel stops
+    void set_name(const char* lock_name) { name = lock_name; }
+
+    static uint64_t now();
+    // spin_start is the result of now() before the first failed attempt, only read if was_contended is set
+    void acquired(uint64_t spin_start, bool was_contended);
+    void released();
+#else
+    constexpr explicit lock_stats(const char* = nullptr) {}
+
+    void set_name(const char*) {}
+    static uint64_t now() { return 0; }
+    void acquired(uint64_t, bool) {}
+    void released() {}
+#endif
+};
+
+/**
+* test and set lock, waiters get the lock in no particular order
+*/
+struct spinlock : private lock_stats {
     volatile uint64_t data = 0;
 
+    constexpr spinlock() = default;
+    constexpr explicit spinlock(const char* name) : lock_stats(name) {}
+    using lock_stats::set_name;
+
+    void lock();
+    void unlock();
+    [[nodiscard]] bool is_locked() const;
+    [[nodiscard]] bool try_lock();
+};
+
+/**
+* fair lock for short sections, cores get the lock in the order they asked for it
+* every waiter still spins on the same cache line, mcs_lock is meant for contended global locks
+*/
+struct ticket_lock : private lock_stats {
+    volatile uint32_t next = 0;   // ticket of the next core that asks
+    volatile uint32_t serving = 0;// ticket that holds the lock
+
+    constexpr ticket_lock() = default;
+    constexpr explicit ticket_lock(const char* name) : lock_stats(name) {}
+
     void lock();
     void unlock();
     [[nodiscard]] bool is_locked() const;
     [[nodiscard]] bool try_lock();
 };
 
+/**
+* fair queue lock for contended locks, every waiter spins on its own node so a release only touches the cache line of the next one
+* the node lives in the lock_guard, so the lock has to be taken through one
+* no kernel lock uses it yet, a lock moves over once the cycles locks::test logs on real cores show it pays off under contention
+*/
+struct mcs_lock : private lock_stats {
+    struct node {
+        node* volatile next;
+        volatile bool waiting;
+    };
+    node* volatile tail = nullptr;// last waiter, or the holder if nobody waits
+
+    constexpr mcs_lock() = default;
+    constexpr explicit mcs_lock(const char* name) : lock_stats(name) {}
+
+    void lock(node& self);
+    void unlock(node& self);
+    [[nodiscard]] bool is_locked() const;
+};
+
+/**
+* reader writer spinlock for read mostly data, any number of readers or one writer hold it
+* a waiting writer keeps new readers out, so a steady stream of readers cannot starve it
+* readers may not take it again while they hold it, a writer waiting in between would deadlock them
+* lock and unlock are the writer side, the statistics only count writers
+*/
+struct rwlock : private lock_stats {
+    static constexpr uint32_t writer = 1u << 31;
+    static constexpr uint32_t writer_waiting = 1u << 30;
+    volatile uint32_t state = 0;// number of readers in the low bits
+
+    constexpr rwlock() = default;
+    constexpr explicit rwlock(const char* name) : lock_stats(name) {}
+
+    void lock();
+    void unlock();
+    [[nodiscard]] bool try_lock();
+    void lock_shared();
+    void unlock_shared();
+    [[nodiscard]] bool try_lock_shared();
+    [[nodiscard]] bool is_locked() const;
+};
+
+/**
+* sequence lock for small data that is copied out by readers, readers never write to the lock
+* a reader copies the data between read_begin and read_retry and starts over while read_retry returns true
+* the copy may be torn until it is validated, so readers may not follow pointers read inside the section
+* lock and unlock are the writer side, writers exclude each other through a spinlock
+*/
+struct seqlock {
+    volatile uint64_t sequence = 0;// odd while a writer is inside
+    spinlock writers;
+
+    constexpr seqlock() = default;
+    constexpr explicit seqlock(const char* name) : writers(name) {}
+
+    [[nodiscard]] uint64_t read_begin() const;
+    [[nodiscard]] bool read_retry(uint64_t start) const;
+    void lock();
+    void unlock();
+};
+
 template<typename LOCK_T>
 struct lock_guard {
     LOCK_T& lock;
@@ -28,4 +156,47 @@ struct lock_guard {
     }
     lock_guard(const lock_guard&) = delete;
     lock_guard& operator=(const lock_guard&) = delete;
-};
\ No newline at end of file
+};
+
+template<>
+struct lock_guard<mcs_lock> {
+    mcs_lock& lock;
+    mcs_lock::node node;
+
+    explicit lock_guard(mcs_lock& lock) : lock(lock) {
+        lock.lock(node);
+    }
+
+    ~lock_guard() {
+        lock.unlock(node);
+    }
+    lock_guard(const lock_guard&) = delete;
+    lock_guard& operator=(const lock_guard&) = delete;
+};
+
+template<typename LOCK_T>
+struct read_guard {
+    LOCK_T& lock;
+
+    explicit read_guard(LOCK_T& lock) : lock(lock) {
+        lock.lock_shared();
+    }
+
+    ~read_guard() {
+        lock.unlock_shared();
+    }
+    read_guard(const read_guard&) = delete;
+    read_guard& operator=(const read_guard&) = delete;
+};
+
+namespace locks {
+/**
+* checks mutual exclusion and measures the cost of an acquisition of every lock type while all online cores contend for it
+*/
+Test::Result test();
+
+/**
+* logs the counters of every lock taken so far, builds without LOCK_STATS_CRACKOS3 have none to show
+*/
+void print_stats();
+}// namespace locks
\ No newline at end of file
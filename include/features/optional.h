@@ -6,7 +6,7 @@
 template<typename T>
 struct optional {
 private:
-    char buffer[sizeof(T)];
+    alignas(T) char buffer[sizeof(T)];
     bool initialized;
 
     void destroy() {
@@ -5,9 +5,23 @@
 #pragma once
 
 #include "int.h"
+#include "memory/kmem_cache.h"
 #include "out/panic.h"
 
+namespace Test {
+struct Result;
+}
+
+// deleters also create the objects of smart pointers and containers, cache_allocator is the alternative to the kernel heap
 struct single_deleter {
+    template<typename T, typename... ArgT>
+    static T* create(ArgT&&... args) {
+        return new T(args...);
+    }
+    template<typename T>
+    static T* create_array(size_t count) {
+        return new T[count];
+    }
     template<typename T>
     static void do_delete(T* ptr) {
         delete ptr;
@@ -50,7 +64,7 @@ public:
     unique_ptr() = default;
     unique_ptr(type* ptr) : ptr(ptr) {}
     template<typename... ArgT>
-    explicit unique_ptr(ArgT&&... args) : ptr(new T(args...)) {}
+    explicit unique_ptr(ArgT&&... args) : ptr(deleter::template create<T>(args...)) {}
     unique_ptr(const unique_ptr&) = delete;
     unique_ptr(unique_ptr&& other) noexcept : ptr(other.ptr) {
         other.ptr = nullptr;
@@ -61,7 +75,7 @@ public:
     unique_ptr& operator=(const unique_ptr&) = delete;
     unique_ptr& operator=(unique_ptr&& other) noexcept {
         if (this != &other) {
-            delete ptr;
+            deleter::do_delete(ptr);
             ptr = other.ptr;
             other.ptr = nullptr;
         }
@@ -109,9 +123,49 @@ public:
     }
 };
 
+/**
+* counts shared by the shared_ptrs and weak_ptrs of one object, every change is atomic so they may be copied on several cores
+* the weak count holds one extra reference for all strong ones together, whoever drops the last weak reference frees the counts
+*/
 struct ref_count {
     size_t strong_count;
     size_t weak_count;
+
+    // every shared_ptr needs one, so they come from their own cache
+    static ref_count* create() {
+        auto* ref = cache_allocator::create<ref_count>();
+        ref->strong_count = 1;
+        ref->weak_count = 1;
+        return ref;
+    }
+
+    // a new reference is made from an existing one, so nothing it guards can be released meanwhile
+    void add_strong() {
+        __atomic_fetch_add(&strong_count, 1, __ATOMIC_RELAXED);
+    }
+    // fails once the object is destroyed, weak_ptr::lock may not revive it
+    bool add_strong_if_alive() {
+        size_t count = __atomic_load_n(&strong_count, __ATOMIC_RELAXED);
+        while (count > 0) {
+            if (__atomic_compare_exchange_n(&strong_count, &count, count + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return true;
+        }
+        return false;
+    }
+    // true for the last strong reference, its owner destroys the object and then calls release_weak
+    bool release_strong() {
+        // the writes through every other reference happen before the object is destroyed
+        size_t previous = __atomic_fetch_sub(&strong_count, 1, __ATOMIC_ACQ_REL);
+        if (previous == 0) panic("shared_ptr: invalid count");
+        return previous == 1;
+    }
+    void add_weak() {
+        __atomic_fetch_add(&weak_count, 1, __ATOMIC_RELAXED);
+    }
+    void release_weak() {
+        size_t previous = __atomic_fetch_sub(&weak_count, 1, __ATOMIC_ACQ_REL);
+        if (previous == 0) panic("weak_ptr: invalid count");
+        if (previous == 1) cache_allocator::do_delete(this);
+    }
 };
 
 template<typename T>
@@ -128,32 +182,30 @@ class shared_ptr {
 public:
     shared_ptr() = default;
     shared_ptr(decltype(nullptr)) : shared_ptr() {}
-    shared_ptr(type* ptr) : ptr(ptr), ref(new ref_count{1, 0}) {}
+    shared_ptr(type* ptr) : ptr(ptr), ref(ref_count::create()) {}
     shared_ptr(type* ptr, ref_count* ref) : ptr(ptr), ref(ref) {
-        if(ref)
-            ref->strong_count++;
+        if (ref)
+            ref->add_strong();
     }
     shared_ptr(const shared_ptr& other) : ptr(other.ptr), ref(other.ref) {
         if (ref)
-            ++ref->strong_count;
+            ref->add_strong();
     }
+    // moves hand the reference over and leave the counts alone
     shared_ptr(shared_ptr&& other) noexcept : ptr(other.ptr), ref(other.ref) {
         other.ptr = nullptr;
         other.ref = nullptr;
     }
     template<typename... ArgT>
-    explicit shared_ptr(ArgT&&... args) : ptr(new T(args...)), ref(new ref_count{1, 0}) {}
+    explicit shared_ptr(ArgT&&... args) : ptr(deleter::template create<T>(args...)), ref(ref_count::create()) {}
     void reset() {
-        if (ref) {
-            if (ref->strong_count == 0) panic("shared_ptr: invalid count");
-            ref->strong_count--;
-            if (ref->strong_count == 0) {
-                deleter::do_delete(ptr);
-                if (ref->weak_count == 0) {
-                    delete ref;
-                    ref = nullptr;
-                }
-            }
+        auto* old_ptr = ptr;
+        auto* old_ref = ref;
+        ptr = nullptr;
+        ref = nullptr;
+        if (old_ref && old_ref->release_strong()) {
+            deleter::do_delete(old_ptr);
+            old_ref->release_weak();
         }
     }
 
@@ -162,22 +214,27 @@ public:
     }
     shared_ptr& operator=(const shared_ptr& other) {
         if (this != &other) {
+            // other may be owned by the object this one releases
+            if (other.ref)
+                other.ref->add_strong();
+            auto* new_ptr = other.ptr;
+            auto* new_ref = other.ref;
             reset();
-            ptr = other.ptr;
-            ref = other.ref;
-            if (ref)
-                ++ref->strong_count;
+            ptr = new_ptr;
+            ref = new_ref;
         }
         return *this;
     }
 
     shared_ptr& operator=(shared_ptr&& other) noexcept {
         if (this != &other) {
-            reset();
-            ptr = other.ptr;
-            ref = other.ref;
+            auto* new_ptr = other.ptr;
+            auto* new_ref = other.ref;
             other.ptr = nullptr;
             other.ref = nullptr;
+            reset();
+            ptr = new_ptr;
+            ref = new_ref;
         }
         return *this;
     }
@@ -214,16 +271,16 @@ public:
     }
 
     [[nodiscard]] size_t use_count() const {
-        return ref->strong_count;
+        return ref ? __atomic_load_n(&ref->strong_count, __ATOMIC_RELAXED) : 0;
     }
 
     void swap(shared_ptr& other) {
         auto tmp = ptr;
         ptr = other.ptr;
         other.ptr = tmp;
-        tmp = ref;
+        auto tmp_ref = ref;
         ref = other.ref;
-        other.ref = tmp;
+        other.ref = tmp_ref;
     }
 };
 
@@ -237,59 +294,179 @@ public:
     weak_ptr() = default;
     template<typename deleter>
     weak_ptr(const shared_ptr<T, deleter>& other) : ptr(other.ptr), ref(other.ref) {
-        ++ref->weak_count;
+        if (ref)
+            ref->add_weak();
     }
     weak_ptr(const weak_ptr& other) : ptr(other.ptr), ref(other.ref) {
-        ++ref->weak_count;
+        if (ref)
+            ref->add_weak();
     }
     weak_ptr(weak_ptr&& other) noexcept : ptr(other.ptr), ref(other.ref) {
         other.ptr = nullptr;
         other.ref = nullptr;
     }
     void reset() {
-        if (ref) {
-            if (ref->weak_count == 0) panic("weak_ptr: invalid count");
-            ref->weak_count--;
-            if (ref->weak_count == 0 && ref->strong_count == 0) {
-                delete ref;
-                ref = nullptr;
-            }
-        }
+        auto* old_ref = ref;
+        ptr = nullptr;
+        ref = nullptr;
+        if (old_ref)
+            old_ref->release_weak();
     }
     ~weak_ptr() {
         reset();
     }
     weak_ptr& operator=(const weak_ptr& other) {
         if (this != &other) {
+            if (other.ref)
+                other.ref->add_weak();
+            auto* new_ptr = other.ptr;
+            auto* new_ref = other.ref;
             reset();
-            ptr = other.ptr;
-            ref = other.ref;
-            ++ref->weak_count;
+            ptr = new_ptr;
+            ref = new_ref;
         }
         return *this;
     }
     weak_ptr& operator=(weak_ptr&& other) noexcept {
         if (this != &other) {
-            reset();
-            ptr = other.ptr;
-            ref = other.ref;
+            auto* new_ptr = other.ptr;
+            auto* new_ref = other.ref;
             other.ptr = nullptr;
             other.ref = nullptr;
+            reset();
+            ptr = new_ptr;
+            ref = new_ref;
         }
         return *this;
     }
     shared_ptr<T> lock() const {
-        if (ref && ref->strong_count > 0) {
-            return shared_ptr<T>(ptr, ref);
+        shared_ptr<T> result;
+        if (ref && ref->add_strong_if_alive()) {
+            // the reference taken above belongs to result
+            result.ptr = ptr;
+            result.ref = ref;
         }
-        return shared_ptr<T>();
+        return result;
     }
     void swap(weak_ptr& other) {
         auto tmp = ptr;
         ptr = other.ptr;
         other.ptr = tmp;
-        tmp = ref;
+        auto tmp_ref = ref;
         ref = other.ref;
-        other.ref = tmp;
+        other.ref = tmp_ref;
+    }
+};
+
+/**
+* base of objects that carry their own count for intrusive_ptr, which saves the separate ref_count of shared_ptr
+* there are no weak references to them, in turn a plain pointer to one can become an intrusive_ptr again at any time
+*/
+class ref_counted {
+    template<typename T, typename deleter>
+    friend class intrusive_ptr;
+
+    size_t references = 0;
+
+protected:
+    ref_counted() = default;
+    // a copy is a new object nobody refers to yet
+    ref_counted(const ref_counted&) {}
+    ref_counted& operator=(const ref_counted&) {
+        return *this;
+    }
+    ~ref_counted() = default;
+};
+
+template<typename T, typename deleter = single_deleter>
+class intrusive_ptr {
+    T* ptr{};
+
+    static void add(T* object) {
+        if (object)
+            __atomic_fetch_add(&object->ref_counted::references, 1, __ATOMIC_RELAXED);
+    }
+    static void release(T* object) {
+        if (!object) return;
+        size_t previous = __atomic_fetch_sub(&object->ref_counted::references, 1, __ATOMIC_ACQ_REL);
+        if (previous == 0) panic("intrusive_ptr: invalid count");
+        if (previous == 1) deleter::do_delete(object);
+    }
+
+public:
+    intrusive_ptr() = default;
+    intrusive_ptr(decltype(nullptr)) : intrusive_ptr() {}
+    intrusive_ptr(T* ptr) : ptr(ptr) {
+        add(ptr);
+    }
+    intrusive_ptr(const intrusive_ptr& other) : ptr(other.ptr) {
+        add(ptr);
+    }
+    intrusive_ptr(intrusive_ptr&& other) noexcept : ptr(other.ptr) {
+        other.ptr = nullptr;
+    }
+    ~intrusive_ptr() {
+        release(ptr);
+    }
+    void reset() {
+        auto* old = ptr;
+        ptr = nullptr;
+        release(old);
+    }
+    intrusive_ptr& operator=(const intrusive_ptr& other) {
+        add(other.ptr);
+        auto* old = ptr;
+        ptr = other.ptr;
+        release(old);
+        return *this;
+    }
+    intrusive_ptr& operator=(intrusive_ptr&& other) noexcept {
+        if (this != &other) {
+            auto* old = ptr;
+            ptr = other.ptr;
+            other.ptr = nullptr;
+            release(old);
+        }
+        return *this;
+    }
+
+    const T* operator->() const {
+        return ptr;
+    }
+    const T& operator*() const {
+        return *ptr;
+    }
+    T* operator->() {
+        return ptr;
+    }
+    T& operator*() {
+        return *ptr;
+    }
+    T* get() {
+        return ptr;
+    }
+    const T* get() const {
+        return ptr;
+    }
+
+    explicit operator bool() const {
+        return ptr;
+    }
+
+    [[nodiscard]] size_t use_count() const {
+        return ptr ? __atomic_load_n(&ptr->ref_counted::references, __ATOMIC_RELAXED) : 0;
+    }
+
+    void swap(intrusive_ptr& other) {
+        auto tmp = ptr;
+        ptr = other.ptr;
+        other.ptr = tmp;
     }
 };
+
+namespace smart_pointers {
+/**
+* copies and releases shared, weak and intrusive pointers to one object on all online cores and checks that it is destroyed exactly once
+*/
+Test::Result test();
+}// namespace smart_pointers
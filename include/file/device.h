@@ -19,14 +19,14 @@ struct device {
         OUT_OF_BOUNDS = 1,
         DEVICE_UNAVAILABLE = 2
     };
-    struct implementation {
+    struct implementation : ref_counted {
         virtual ~implementation() = default;
         virtual result<size_t, error_t> read(void* buffer, size_t offset, size_t size) = 0;
         virtual result<size_t, error_t> write(void* buffer, size_t offset, size_t size) = 0;
     };
 
     size_t size;
-    shared_ptr<implementation> impl;
+    intrusive_ptr<implementation> impl;
 
     result<size_t, error_t> read(void* buffer, size_t offset, size_t count) {
         return impl->read(buffer, offset, count);
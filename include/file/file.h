@@ -7,7 +7,8 @@
 
 namespace file {
 
-struct file {
+// every process keeps its image open, the count lives in the file so opening one takes a single allocation
+struct file : ref_counted {
 
     enum class type_t {
         normal,
@@ -29,6 +30,9 @@ struct file {
         virtual size_t get_directory_entries(directory_entry* buffer, size_t offset, size_t size) = 0;
     };
 
+    // takes ownership of impl, nullptr makes an invalid file
+    explicit file(implementation* impl) : impl(impl) {}
+
     size_t read(void* buffer, size_t offset, size_t size) {
         return impl->read(buffer, offset, size);
     }
@@ -10,4 +10,9 @@ namespace Interrupt {
 
 void init_default_handlers();
 
+// returns true if the fault was resolved and the access can be retried
+// runs inside the page fault handler with interrupts disabled, it may only wait by polling, never for an interrupt
+using page_fault_resolver_t = bool (*)(VirtualAddress address, uint64_t error);
+void set_page_fault_resolver(page_fault_resolver_t resolver);
+
 }// namespace Interrupt
\ No newline at end of file
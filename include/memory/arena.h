@@ -0,0 +1,59 @@
+#pragma once
+
+#include "features/types.h"
+#include "memory/mem.h"
+#include "test/test.h"
+
+/**
+* per cpu bump allocator for scratch memory that only lives for one operation, like a syscall or a path lookup
+* a scope remembers the position of the arena of its cpu and frees everything allocated after it when it ends
+* scopes end in the reverse order they started and may not stay open across a thread switch, interrupt handlers may open their own
+*/
+namespace arena {
+
+struct cpu_arena;
+struct chunk;
+
+/**
+* allocates size bytes in the arena of the current cpu, the memory is not zeroed
+* memory allocated outside of any scope is never freed
+*/
+void* allocate(size_t size, size_t alignment = 16);
+
+class scope {
+    cpu_arena* owner;
+    chunk* start_chunk;
+    size_t start_offset;
+
+public:
+    scope();
+    ~scope();
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+};
+
+/**
+* allocator for containers that puts their nodes into the arena, do_delete only destroys the object
+*/
+struct allocator {
+    template<typename T, typename... ArgT>
+    static T* create(ArgT&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<ArgT>(args)...);
+    }
+    template<typename T>
+    static T* create_array(size_t count) {
+        auto* objects = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+        for (size_t i = 0; i < count; ++i) {
+            new (&objects[i]) T();
+        }
+        return objects;
+    }
+    template<typename T>
+    static void do_delete(T* ptr) {
+        if (ptr) ptr->~T();
+    }
+};
+
+Test::Result test();
+
+}// namespace arena
@@ -5,15 +5,60 @@
 #include "test/test.h"
 
 namespace kheap {
+
+static constexpr size_t small_class_count = 10;
+
+struct ClassStats {
+    uint64_t size;  // object size of the class
+    uint64_t live;  // objects handed out right now, objects freed by another cpu count until their owner collects them
+    uint64_t pages; // slab pages of the class, the empty ones kept for reuse included
+    uint64_t allocs;// allocations since boot
+    uint64_t frees;
+    uint64_t wasted;// bytes all allocations since boot lost by rounding up to size
+};
+
+struct Stats {
+    ClassStats classes[small_class_count];
+    uint64_t pages;      // single pages handed out by the page allocator
+    uint64_t page_tables;// level 1 and 2 tables of the page and slab heap, each with its summary page
+    uint64_t large_regions;
+    uint64_t large_bytes;
+    uint64_t large_free_extents;
+    uint64_t large_allocs;
+    uint64_t large_frees;
+    uint64_t sampled;// allocations recorded by sampling
+};
+
 void init();
 void* malloc(size_t size);
 void free(void* ptr);
+/**
+* resizes the memory at ptr to size bytes, the contents up to the smaller size are kept
+* the memory stays in place if it still fits its size class or a large region can grow into the free space behind it
+* @returns the new location or nullptr if no memory was left, ptr stays valid in that case
+*/
+void* realloc(void* ptr, size_t size);
 optional<size_t> get_size(void* ptr);
+Stats stats();
+/**
+* logs the statistics and the allocation rates since the last report
+*/
+void print_stats();
+/**
+* records the caller of every interval-th allocation, 0 stops the sampling
+* the callers share a fixed table, callers that find it full are only counted as dropped
+*/
+void set_sampling(uint64_t interval);
+/**
+* logs the count most sampled callers
+*/
+void print_samples(size_t count);
 Test::Result test();
 }// namespace kheap
 
 inline void* kmalloc(size_t size) { return kheap::malloc(size); }
 inline void kfree(void* ptr) { kheap::free(ptr); }
+inline void* krealloc(void* ptr, size_t size) { return kheap::realloc(ptr, size); }
 inline optional<size_t> ksize(void* ptr) { return kheap::get_size(ptr); }
 
 void* operator new(size_t size);
@@ -0,0 +1,202 @@
+#pragma once
+
+#include "ACPI/APIC.h"
+#include "asm/regs.h"
+#include "asm/util.h"
+#include "features/lock.h"
+#include "features/types.h"
+#include "memory/heap.h"
+#include "test/test.h"
+
+struct kmem_cache_stats {
+    uint64_t slabs;    // slabs taken from the kernel heap, they are never given back
+    uint64_t allocated;// objects handed out right now
+    uint64_t cached;   // free objects waiting in the cache
+};
+
+/**
+* cache of objects of type T, carved from slabs that only hold objects of this type
+* every cpu keeps its own list of free objects and only locks the shared list to exchange batches with it
+* objects are not zeroed, create constructs them in place and destroy returns them to the cache
+* with construct_once every object is constructed once when its slab is created, create and destroy only hand it out and take it back,
+* so a destroyed object has to be in its constructed state again
+* a cache has to have static storage duration, its zero state is the empty cache
+*/
+template<typename T, bool construct_once = false>
+class kmem_cache {
+    struct slot {
+        alignas(T) uint8_t storage[sizeof(T)];
+        slot* next;// free slots, the link lies behind the object so construct_once objects stay intact
+    };
+    // small objects share a page, large ones get slabs of 8 objects
+    static constexpr size_t objects_per_slab = sizeof(slot) * 8 <= page_size ? page_size / sizeof(slot) : 8;
+    static constexpr size_t slab_size = objects_per_slab * sizeof(slot);
+
+    // apic ids are 8 bit, so this covers every core initLocalAPIC can bring up
+    static constexpr size_t max_cpu_count = 256;
+    // free slots moved between a cpu and the shared list at once
+    static constexpr size_t batch = 16;
+
+    struct alignas(64) free_slots {
+        slot* head = nullptr;
+        uint64_t count = 0;
+        int64_t allocated = 0;// creates minus destroys, only the sum over all cpus is meaningful
+    };
+
+    // the list of a cpu is only touched by that cpu with interrupts disabled, the shared one under lock
+    free_slots cpus[max_cpu_count]{};
+    ticket_lock lock{"kmem cache"};
+    free_slots shared{};
+    uint64_t slabs = 0;
+
+    static slot* slot_of(T* ptr) {
+        return reinterpret_cast<slot*>(ptr);
+    }
+
+    free_slots& local() {
+        return cpus[APIC::get_cpu_number()];
+    }
+
+    static void move_one(free_slots& from, free_slots& to) {
+        auto* object = from.head;
+        from.head = object->next;
+        from.count--;
+        object->next = to.head;
+        to.head = object;
+        to.count++;
+    }
+
+    // takes up to batch slots from the shared list, false if it is empty
+    bool refill(free_slots& list) {
+        lock.lock();
+        bool found = shared.head != nullptr;
+        for (size_t i = 0; i < batch && shared.head; ++i) {
+            move_one(shared, list);
+        }
+        lock.unlock();
+        return found;
+    }
+
+    void drain(free_slots& list) {
+        lock.lock();
+        for (size_t i = 0; i < batch; ++i) {
+            move_one(list, shared);
+        }
+        lock.unlock();
+    }
+
+    // takes a new slab from the kernel heap, called with the interrupts of the caller since the page heap may wait for other cores
+    slot* new_slab() {
+        auto* slab = static_cast<slot*>(kmalloc(slab_size));
+        if (slab == nullptr) return nullptr;
+        for (size_t i = 0; i < objects_per_slab; ++i) {
+            if constexpr (construct_once) {
+                new (slab[i].storage) T();
+            }
+            slab[i].next = i + 1 < objects_per_slab ? &slab[i + 1] : nullptr;
+        }
+        __atomic_add_fetch(&slabs, 1, __ATOMIC_RELAXED);
+        return slab;
+    }
+
+    T* pop() {
+        // interrupt handlers may allocate too, so the lists are only touched with interrupts disabled
+        auto flags = getFlags();
+        cli();
+        auto* list = &local();
+        if (list->head == nullptr && !refill(*list)) {
+            setFlags(flags);
+            auto* slab = new_slab();
+            if (slab == nullptr) return nullptr;
+            cli();
+            list = &local();
+            slab[objects_per_slab - 1].next = list->head;
+            list->head = slab;
+            list->count += objects_per_slab;
+        }
+        auto* object = list->head;
+        list->head = object->next;
+        list->count--;
+        list->allocated++;
+        setFlags(flags);
+        return reinterpret_cast<T*>(object->storage);
+    }
+
+    void push(T* ptr) {
+        auto flags = getFlags();
+        cli();
+        auto& list = local();
+        auto* object = slot_of(ptr);
+        object->next = list.head;
+        list.head = object;
+        list.count++;
+        list.allocated--;
+        // a cpu that frees more than it allocates hands the surplus to the others
+        if (list.count >= 2 * batch) drain(list);
+        setFlags(flags);
+    }
+
+public:
+    template<typename... ArgT>
+    T* create(ArgT&&... args) {
+        auto* object = pop();
+        if (object == nullptr) return nullptr;
+        if constexpr (construct_once) {
+            static_assert(sizeof...(ArgT) == 0, "construct_once objects are already constructed");
+            return object;
+        } else {
+            return new (object) T(std::forward<ArgT>(args)...);
+        }
+    }
+
+    void destroy(T* ptr) {
+        if (ptr == nullptr) return;
+        if constexpr (!construct_once) {
+            ptr->~T();
+        }
+        push(ptr);
+    }
+
+    // the lists of other cpus are read without their interrupts off, so the sums are only exact while no other cpu uses the cache
+    [[nodiscard]] kmem_cache_stats get_stats() {
+        kmem_cache_stats result{};
+        result.slabs = __atomic_load_n(&slabs, __ATOMIC_RELAXED);
+        int64_t allocated = 0;
+        for (auto& list : cpus) {
+            result.cached += list.count;
+            allocated += list.allocated;
+        }
+        auto flags = getFlags();
+        cli();
+        lock.lock();
+        result.cached += shared.count;
+        lock.unlock();
+        setFlags(flags);
+        result.allocated = allocated;
+        return result;
+    }
+};
+
+/**
+* the cache every cache_allocator uses for objects of type T
+*/
+template<typename T>
+inline kmem_cache<T> type_cache;
+
+/**
+* allocator for containers and deleter for smart pointers that takes objects from the cache of their type instead of kmalloc
+*/
+struct cache_allocator {
+    template<typename T, typename... ArgT>
+    static T* create(ArgT&&... args) {
+        return type_cache<T>.create(std::forward<ArgT>(args)...);
+    }
+    template<typename T>
+    static void do_delete(T* ptr) {
+        type_cache<T>.destroy(ptr);
+    }
+};
+
+namespace kmem {
+Test::Result test();
+}// namespace kmem
@@ -5,6 +5,10 @@
 template<typename T>
 struct optional;
 
+namespace Test {
+struct Result;
+}
+
 #define saveReadSymbol(name) [&]() -> uint64_t { \
     uint64_t tmp;                                \
     asm volatile("movabs $" name ", %0"          \
@@ -89,7 +93,7 @@ union VirtualAddress {
     constexpr VirtualAddress(uint64_t data) : address(data) {}
 
     constexpr VirtualAddress() : address(0) {}
-    constexpr VirtualAddress(uint16_t offset, uint16_t l1, uint16_t l2, uint16_t l3, uint16_t l4) : offset(offset), l1Offset(l1), l2Offset(l2), l3Offset(l3), l4Offset(l4) {}
+    constexpr VirtualAddress(uint16_t offset, uint16_t l1, uint16_t l2, uint16_t l3, uint16_t l4) : offset(offset), l1Offset(l1), l2Offset(l2), l3Offset(l3), l4Offset(l4), padding(0) {}
 
     friend VirtualAddress& operator+=(VirtualAddress& lhs, size_t rhs) {
         lhs.address += rhs;
@@ -126,10 +130,28 @@ static_assert(sizeof(VirtualAddress) == 8);
 
 namespace PhysicalAllocator {
 
+struct MagazineStats {
+    uint64_t alloc_hits;// single page allocations served from the cpu cache
+    uint64_t free_hits; // single page frees kept in the cpu cache
+    uint64_t refills;   // batches taken from the buddy allocator
+    uint64_t drains;    // batches given back to the buddy allocator
+};
+
 void init(PhysicalAddress multiboot_info);
 optional<PhysicalAddress> alloc(uint64_t count);
 void free(PhysicalAddress address, uint64_t count);
 void clear_startup();
+MagazineStats magazine_stats();
+/**
+* adds an owner to an allocated page, a shared page is only freed by release when its last owner drops it
+*/
+void add_reference(PhysicalAddress page);
+/**
+* drops one owner of a page that was allocated with alloc(1), the last owner frees it
+*/
+void release(PhysicalAddress page);
+uint64_t reference_count(PhysicalAddress page);
+Test::Result test();
 
 }// namespace PhysicalAllocator
 
@@ -142,17 +164,22 @@ inline int memcmp(const void* a, const void* b, uint64_t count) {
     return 0;
 }
 
+// rep advances rdi, so the instructions get a copy of dst
 inline void* memcpy(void* dst, const void* src, uint64_t count) {
+    void* cursor = dst;
     asm volatile("rep movsb"
-                 : "+S"(src), "+c"(count)
-                 : "D"(dst));
+                 : "+D"(cursor), "+S"(src), "+c"(count)
+                 :
+                 : "memory");
     return dst;
 }
 
 inline void* memset(void* dst, uint8_t value, uint64_t count) {
+    void* cursor = dst;
     asm volatile("rep stosb"
-                 : "+c"(count), "+a"(value)
-                 : "D"(dst));
+                 : "+D"(cursor), "+c"(count)
+                 : "a"(value)
+                 : "memory");
     return dst;
 }
 
@@ -3,14 +3,22 @@
 #include "features/optional.h"
 #include "memory/mem.h"
 
+namespace Test {
+struct Result;
+}
+
 namespace PageTable {
 struct Flags {
     bool writeable : 1;
     bool user : 1;
     bool writeThrough : 1;
     bool cacheDisabled : 1;
+    bool global : 1;// kept in the tlb across address space switches, required for the kernel half and not allowed below it
 };
 
+/**
+* the avl bits of an entry, on entries that point to a table the upper 11 bits count the present entries of that table
+*/
 struct PageMetaData {
     uint16_t data : 14;
 };
@@ -43,14 +51,76 @@ struct PageTable {
 static_assert(sizeof(PageTable) == page_size, "PageTable is not page_size bytes");
 
 void init();
+/**
+* enables the paging features init detected on the calling core, every application processor calls it once
+*/
+void init_core();
 void map(PhysicalAddress p, VirtualAddress v, Flags f);
+/**
+* maps a single 2MiB (level 2) or 1GiB (level 3) page, p and v have to be aligned to the page size
+*/
+void map_huge(PhysicalAddress p, VirtualAddress v, uint8_t level, Flags f);
+/**
+* maps size bytes starting at p to v, using huge pages where both addresses are aligned
+*/
+void map_range(PhysicalAddress p, VirtualAddress v, uint64_t size, Flags f);
+/**
+* maps into the address space with the given level 4 table instead of the current one
+*/
+void map_range(PhysicalAddress space, PhysicalAddress p, VirtualAddress v, uint64_t size, Flags f);
+/**
+* maps the pages of size bytes at from in from_space to to in to_space without copying them
+* both sides become read only, with a writeable f the pages are copied on the first write, pages not mapped at from are skipped
+*/
+void share_range(PhysicalAddress from_space, VirtualAddress from, PhysicalAddress to_space, VirtualAddress to, uint64_t size, Flags f);
+/**
+* gives the copy on write page at v its own copy (or the page itself for its last owner) and makes it writeable
+* @returns false if v is not a copy on write page
+*/
+bool copy_on_write(PhysicalAddress space, VirtualAddress v);
 void unmap(VirtualAddress v);
+/**
+* unmaps size bytes starting at v, huge pages that are only partially covered are split
+* page tables that become empty are freed, except the level 3 tables of the kernel half
+*/
+void unmap_range(VirtualAddress v, uint64_t size);
+void unmap_range(PhysicalAddress space, VirtualAddress v, uint64_t size);
+/**
+* creates a level 4 table with an empty program half (below 32TiB) that shares the kernel half with every other address space
+* the returned value is loaded into cr3 as is, with pcid support its low 12 bits are the pcid of the space
+*/
+PhysicalAddress create_address_space();
+/**
+* frees the page tables of the program half and drops the reference of every page mapped there, a page that loses its last reference is freed
+*/
+void destroy_address_space(PhysicalAddress space);
+void switch_address_space(PhysicalAddress space);
+PhysicalAddress current_address_space();
+PhysicalAddress kernel_address_space();
 void clear_startup();
+/**
+* invalidates the tlb entries of size bytes starting at v in the given address space on this core
+*/
+void invalidate_local(PhysicalAddress space, VirtualAddress v, uint64_t size);
+/**
+* invalidates the tlb entries of size bytes starting at v in the given address space on all cores
+*/
+void invalidate(PhysicalAddress space, VirtualAddress v, uint64_t size);
+/**
+* drops every tlb entry including global ones and every cached page table of every address space on all cores
+*/
+void invalidate_all();
+/**
+* drops the cached page tables above v in the kernel half on all cores after a table there was freed, global tlb entries stay
+*/
+void invalidate_kernel_tables(VirtualAddress v);
 optional<PhysicalAddress> get(VirtualAddress v);
 optional<PageMetaData> getMetaData(VirtualAddress v, uint8_t level);
 /**
+* sets the avl bits of the entry at level, entries that point to a table are refused because their bits hold its count
 * @returns true if the metadata was set, false if not
 */
 bool setMetaData(VirtualAddress v, uint8_t level, PageMetaData metaData, bool allocateIfNotPresent);
+Test::Result test();
 
 }// namespace PageTable
\ No newline at end of file
@@ -19,6 +19,18 @@ struct memory_area {
     PhysicalAddress phys;
     PageTable::Flags flags{};
     size_t size{};
+    // demand paged areas have no physical memory until a page is touched, phys is unused for them
+    bool on_demand{};
+    // the first file_size bytes of a demand paged area are read from the process image at file_offset, the rest is zero filled
+    uint64_t file_offset{};
+    uint64_t file_size{};
+};
+
+struct fault_counters {
+    uint64_t zero_fill;
+    uint64_t file_backed;
+    uint64_t copy_on_write;
+    uint64_t failed;
 };
 
 using pid_t = uint64_t;
@@ -33,8 +45,8 @@ struct execute_context {
 struct thread {
     execute_context context;
     weak_ptr<process> owner;
-    linked_list<shared_ptr<process>> working_in;
-    linked_list<memory_area> memory;
+    linked_list<shared_ptr<process>, cache_allocator> working_in;
+    linked_list<memory_area, cache_allocator> memory;
 
     [[nodiscard]] inline shared_ptr<process> get_current() const {
         if (working_in.size == 0) {
@@ -47,7 +59,12 @@ struct thread {
     VirtualAddress code_ptr;
 
     void execute();
-    void load();
+    // the process whose address space is loaded while this thread runs, nullptr if none of them
+    [[nodiscard]] shared_ptr<process> get_loaded() const;
+    // maps the memory of this thread (its stack) into the address space of target
+    void load(process& target);
+    // removes the memory of this thread from the address space of target again, target may not be loaded
+    void unload(process& target);
 
     void on_syscall_disown(syscall::disown_data* data);
     void on_syscall_adopt(syscall::adopt_data* data);
@@ -79,6 +96,7 @@ struct process {
         size_t expected_argument_count;
         VirtualAddress call_address;
     };
+    // methods, name and the relations up to adopter are guarded by the process tree lock in process.cpp
     linked_list<method_descriptor> methods;
 
     string name;
@@ -86,16 +104,19 @@ struct process {
     thread main_thread;
 
     weak_ptr<process> parent;
-    linked_list<shared_ptr<process>> children;
+    linked_list<shared_ptr<process>, cache_allocator> children;
     linked_list<weak_ptr<process>> friends;
     linked_list<weak_ptr<process>> pending_adoption;
     weak_ptr<process> adopter;
     weak_ptr<process> self;
 
-    linked_list<memory_area> memory; // 0 - (16TiB-stack_size)
+    PhysicalAddress address_space; // level 4 table, the kernel half is shared with all other processes
+    linked_list<memory_area, cache_allocator> memory; // 0 - (16TiB-stack_size)
+    intrusive_ptr<file::file> image; // backs the file part of demand paged areas
+    fault_counters faults{};
     // shared memory between A and B could be implemented by A calling a B function and returning to A
     // that way A keeps its thread but guarantees that B is running and can map memory in the method_call_argument_memory
-    btree_map<VirtualAddress, memory_area> method_call_argument_memory; // 16TiB - 32TiB
+    btree_map<VirtualAddress, memory_area, cache_allocator> method_call_argument_memory; // 16TiB - 32TiB
 
     template<typename ...ArgumentDescriptor>
     void add_kernel_method(const string& method_name, VirtualAddress call_address, ArgumentDescriptor... descriptors) {
@@ -104,17 +125,37 @@ struct process {
     }
     void add_kernel_method_by_array(const string& name, VirtualAddress call_address, const method_descriptor::argument_descriptor* arguments, size_t argument_count);
 
+    // the caller holds the process tree lock as a writer
     void cleanup_dead();
+    // links child into the tree below this process
+    void add_child(shared_ptr<process> child);
 
     process();
+    ~process();
 
+    // the caller holds the process tree lock as a writer
     void handle_disown();
 
+    // switches to the address space of this process
     void load();
-
+    void map(const memory_area& area);
+    // maps the page containing address if it belongs to a demand paged area, returns false if it does not
+    // called from the page fault handler with interrupts disabled, the file backed part is read from the disk by polling the port
+    // the faulting code must not hold the lock of that port, the core would spin on its own lock
+    bool handle_page_fault(VirtualAddress address);
+    // copies the page containing address if it is shared copy on write, returns false if it is not
+    bool handle_write_fault(VirtualAddress address);
+
+    // lookups only take the process tree lock as readers, so they run on all cores at once
     shared_ptr<process> get_process_by_descriptor(const syscall::process_descriptor& descriptor, bool with_adoption = false);
+
+private:
+    shared_ptr<process> find_by_descriptor(const syscall::process_descriptor& descriptor, bool with_adoption);
 };
 
-shared_ptr<process> from_elf(file::file& file);
+shared_ptr<process> from_elf(intrusive_ptr<file::file> file);
+
+// logs the page fault counters of every process in the tree of the calling thread, the counters are otherwise only logged on teardown
+void print_fault_counters();
 
 }// namespace proc
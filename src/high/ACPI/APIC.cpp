@@ -9,6 +9,8 @@
 #include "features/lock.h"
 #include "features/math.h"
 #include "interrupt/interrupt.h"
+#include "memory/heap.h"
+#include "memory/paging.h"
 #include "out/log.h"
 
 namespace APIC {
@@ -21,11 +23,13 @@ struct io_interrupt_source_override {
 PhysicalAddress local_apic_address;
 CPU_Core* cores = nullptr;
 size_t core_count;
-spinlock core_init_lock;
+spinlock core_init_lock{"core init"};
 IOAPIC* ioapics = nullptr;
 size_t ioapic_count;
 io_interrupt_source_override* io_interrupt_source_overrides = nullptr;
 size_t io_interrupt_source_override_count;
+// gs points here until the boot processor knows its core, self stays nullptr
+static CPU_Local boot_local{};
 
 struct Table {
     char signature[4];
@@ -116,6 +120,12 @@ void MADT::init() {
             core.acpi_id = entry->acpi_processor_id;
             core.apic_id = entry->apic_id;
             core.os_id = core_index;
+            // a page sized request is served by the page heap, so the block is alone on its page
+            static_assert(sizeof(CPU_Local) <= page_size);
+            core.local = new (kmalloc(page_size)) CPU_Local{};
+            core.local->self = core.local;
+            core.local->core = &core;
+            core.local->os_id = core.os_id;
             core_index++;
             Log::printf(Log::Debug, "APIC", "Found core %i with acpi id %i and apic id %i\n", core.os_id, core.acpi_id, core.apic_id);
         }
@@ -222,17 +232,9 @@ static void initIOAPIC() {
     }
 }
 
-struct timer_data {
-    uint64_t ticks_needed;
-    uint64_t prev_init;
-    void (*callback)(void*);
-    void* data;
-};
-
 static volatile bool pit_bootstrap_timer_running = false;
 static uint32_t ticks_per_ms;
-static timer_data* timer_data_array;
-static uint8_t timer_interrupt;
+static uint8_t timer_interrupt;// 0 until the timer is calibrated
 static void initLocalAPICTimer() {
     Interrupt::Guard i_guard;
     // prepare PIT timer
@@ -277,7 +279,6 @@ static void initLocalAPICTimer() {
     ticks_per_ms = average_count;
     Log::printf(Log::Debug, "APIC", "Average ticks per ms: %i\n", ticks_per_ms);
     IOAPIC::interrupt_set_mask(0, true);
-    timer_data_array = new timer_data[core_count];
     timer_interrupt = Interrupt::get_free_interrupt_number();
 }
 
@@ -285,11 +286,136 @@ LocalAPIC get_current_lapic() {
     return {local_apic_address.mapTmp()};
 }
 
+// one tlb shootdown at a time, the initiator waits until every other online core acknowledged it
+static uint8_t shootdown_vector = 0;
+static spinlock shootdown_lock{"tlb shootdown"};
+static volatile uint64_t shootdown_generation = 0;
+static volatile uint64_t shootdown_space;
+static volatile uint64_t shootdown_start;
+static volatile uint64_t shootdown_size;
+static volatile uint64_t shootdown_pending;
+static volatile uint64_t* shootdown_seen = nullptr;// last handled generation, indexed by os_id
+
+static void handle_shootdown(CPU_Core& core) {
+    uint64_t generation = shootdown_generation;
+    if (shootdown_seen[core.os_id] == generation) return;
+    PageTable::invalidate_local(shootdown_space, shootdown_start, shootdown_size);
+    shootdown_seen[core.os_id] = generation;
+    __atomic_sub_fetch(&shootdown_pending, 1, __ATOMIC_SEQ_CST);
+}
+
+struct interrupt_frame;
+extern "C" __attribute__((interrupt)) void shootdown_interrupt(interrupt_frame*) {
+    if (auto* core = get_current_cpu()) {
+        handle_shootdown(*core);
+    }
+    get_current_lapic().end_of_interrupt() = 0;
+}
+
+void shootdown_tlb(PhysicalAddress space, VirtualAddress start, uint64_t size) {
+    if (shootdown_vector == 0) return;
+    auto* self = get_current_cpu();
+    if (!self) return;
+    while (!shootdown_lock.try_lock()) {
+        // the current owner may wait for this core while interrupts are disabled here
+        handle_shootdown(*self);
+        asm("pause");
+    }
+    uint64_t targets = 0;
+    for (size_t i = 0; i < core_count; ++i) {
+        if (cores[i].online && &cores[i] != self) targets++;
+    }
+    if (targets == 0) {
+        shootdown_lock.unlock();
+        return;
+    }
+    shootdown_space = space.address;
+    shootdown_start = start.address;
+    shootdown_size = size;
+    shootdown_pending = targets;
+    uint64_t generation = __atomic_add_fetch(&shootdown_generation, 1, __ATOMIC_SEQ_CST);
+    shootdown_seen[self->os_id] = generation;
+    auto apic = get_current_lapic();
+    for (size_t i = 0; i < core_count; ++i) {
+        if (!cores[i].online || &cores[i] == self) continue;
+        apic.send_interrupt(LocalAPIC::InterruptType::Normal, shootdown_vector, cores[i].apic_id);
+        while (apic.is_interrupt_pending()) { asm("pause"); }
+    }
+    while (shootdown_pending) { asm("pause"); }
+    shootdown_lock.unlock();
+}
+
+// one job at a time, the call vector only wakes the idle application processors, they run the job outside of the interrupt
+static uint8_t call_vector = 0;
+static spinlock call_lock{"core call"};
+static void (*volatile call_job)(void*);
+static void* volatile call_data;
+static volatile uint64_t call_generation = 0;
+static volatile uint64_t call_pending;
+static volatile uint64_t* call_seen = nullptr;// last run generation, indexed by os_id
+
+extern "C" __attribute__((interrupt)) void call_interrupt(interrupt_frame*) {
+    get_current_lapic().end_of_interrupt() = 0;
+}
+
+void run_on_all_cores(void (*job)(void*), void* data) {
+    auto* self = get_current_cpu();
+    if (!self || call_vector == 0) {
+        job(data);
+        return;
+    }
+    lock_guard guard(call_lock);
+    uint64_t targets = 0;
+    for (size_t i = 0; i < core_count; ++i) {
+        if (cores[i].online && &cores[i] != self) targets++;
+    }
+    call_job = job;
+    call_data = data;
+    call_pending = targets;
+    uint64_t generation = __atomic_add_fetch(&call_generation, 1, __ATOMIC_SEQ_CST);
+    call_seen[self->os_id] = generation;
+    auto apic = get_current_lapic();
+    for (size_t i = 0; i < core_count; ++i) {
+        if (!cores[i].online || &cores[i] == self) continue;
+        apic.send_interrupt(LocalAPIC::InterruptType::Normal, call_vector, cores[i].apic_id);
+        while (apic.is_interrupt_pending()) { asm("pause"); }
+    }
+    job(data);
+    while (call_pending) { asm("pause"); }
+}
+
+static void go_online(CPU_Core& core) {
+    lock_guard guard(shootdown_lock);
+    shootdown_seen[core.os_id] = shootdown_generation;
+    call_seen[core.os_id] = call_generation;
+    core.online = true;
+}
+
+void init_cpu_local() {
+    setGSBase((uint64_t) &boot_local);
+}
+
+// finds the core by its local apic id, only used once per core to find its block
+static CPU_Core& find_current_core() {
+    auto id = get_current_lapic().get_id();
+    for (uint64_t i = 0; i < core_count; i++) {
+        if (cores[i].apic_id == id) {
+            return cores[i];
+        }
+    }
+    panic("core not listed in the madt");
+}
+
+static void setup_cpu_local() {
+    setGSBase((uint64_t) find_current_core().local);
+}
+
 static volatile bool ap_response = false;
 static dtr_t idt_ptr;
 void initLocalAPIC() {
     if (cores == nullptr)
         panic("apic not initialized");
+    setup_cpu_local();
     ioWrite8(0xa1, 0xff);
     ioWrite8(0x21, 0xff);
     auto apic = get_current_lapic();
@@ -298,6 +424,17 @@ void initLocalAPIC() {
 
     initLocalAPICTimer();
 
+    shootdown_seen = new uint64_t[core_count]{};
+    shootdown_vector = Interrupt::get_free_interrupt_number();
+    // reserve the vector, the native handler below replaces the generic dispatch
+    Interrupt::registerHandler(shootdown_vector, [](uint8_t, uint64_t, void*, void*) {});
+    Interrupt::setNativeInterruptHandler(VirtualAddress(shootdown_interrupt), shootdown_vector, 0);
+    call_seen = new uint64_t[core_count]{};
+    call_vector = Interrupt::get_free_interrupt_number();
+    Interrupt::registerHandler(call_vector, [](uint8_t, uint64_t, void*, void*) {});
+    Interrupt::setNativeInterruptHandler(VirtualAddress(call_interrupt), call_vector, 0);
+    go_online(*get_current_cpu());
+
     uint64_t trampoline_address = saveReadSymbol("trampoline_entry_16");
     if (trampoline_address == 0)
         panic("trampoline not found");
@@ -309,7 +446,7 @@ void initLocalAPIC() {
     Log::printf(Log::Debug, "APIC", "trampoline vector: %x\n", trampoline_vector);
 
     auto* pagetable_ptr = PhysicalAddress(saveReadSymbol("trampoline_data_pagetable_l4")).mapTmp().as<uint64_t*>();
-    *pagetable_ptr = getCR3();
+    *pagetable_ptr = PageTable::kernel_address_space().address;
 
     auto* gdt_ptr = PhysicalAddress(saveReadSymbol("trampoline_data_gdt_ptr")).mapTmp().as<uint64_t*>();
     asm("sgdt %0"
@@ -355,21 +492,21 @@ void initLocalAPIC() {
 }
 
 CPU_Core* get_current_cpu() {
-    auto id = get_current_lapic().get_id();
-    if (cores == nullptr) {
-        return nullptr;
-    }
-    for (uint64_t i = 0; i < core_count; i++) {
-        if (cores[i].apic_id == id) {
-            return &cores[i];
-        }
-    }
-    return nullptr;
+    auto* local = get_cpu_local();
+    return local ? local->core : nullptr;
 }
 size_t get_core_count() {
     return core_count;
 }
 
+size_t get_online_core_count() {
+    size_t count = 0;
+    for (size_t i = 0; i < core_count; ++i) {
+        if (cores[i].online) count++;
+    }
+    return count;
+}
+
 void LocalAPIC::send_interrupt(InterruptType type, uint8_t vector, uint32_t local_apic_id) {
     union interrupt_command_low_t {
         uint32_t raw;
@@ -409,7 +546,7 @@ bool LocalAPIC::is_interrupt_pending() {
 }
 static constexpr uint64_t max_timer_ticks = (0b1ul << 31) - 1;
 static void onLocalTimer(uint8_t, uint64_t, void* stack_ptr, void* user_data) {
-    auto& timer_data = timer_data_array[get_current_lapic().get_id()];
+    auto& timer_data = get_cpu_local()->timer;
     timer_data.ticks_needed -= timer_data.prev_init;
     if (timer_data.ticks_needed == 0) {
         if (timer_data.callback) timer_data.callback(timer_data.data);
@@ -422,14 +559,14 @@ static void onLocalTimer(uint8_t, uint64_t, void* stack_ptr, void* user_data) {
 void LocalAPIC::sleep() {
     Interrupt::Guard guard;
     Interrupt::enable();
-    volatile auto& timer_data = timer_data_array[get_id()];
+    volatile auto& timer_data = get_cpu_local()->timer;
     while (timer_data.ticks_needed > 0) {
         uint32_t current = current_count();
         asm("pause");
     }
 }
 void LocalAPIC::sleep(duration_t duration) {
-    auto& timer_data = timer_data_array[get_id()];
+    auto& timer_data = get_cpu_local()->timer;
     if (timer_data.ticks_needed != 0) {
         panic("timer already running");
     }
@@ -438,9 +575,9 @@ void LocalAPIC::sleep(duration_t duration) {
     sleep();
 }
 void LocalAPIC::notify(duration_t duration, void (*callback)(void*), void* data) {
-    if (timer_data_array == nullptr)
+    if (timer_interrupt == 0)
         return;
-    auto& timer_data = timer_data_array[get_id()];
+    auto& timer_data = get_cpu_local()->timer;
     if (timer_data.ticks_needed)
         return;
 
@@ -500,15 +637,64 @@ void IOAPIC::interrupt_set_mask(uint8_t io_vector, bool mask) {
 }
 
 extern "C" void ap_cpu() {
+    setup_cpu_local();
     ap_response = true;
     setIDTR(idt_ptr);
+    PageTable::init_core();
+    get_current_lapic().spurious_interrupt_vector() = 0x100 | 0xff;
+    go_online(*get_current_cpu());
     Interrupt::enable();
     auto id = get_current_lapic().get_id();
     Log::printf(Log::Info, "APIC", "AP CPU %i started\n", id);
+    // idle with interrupts enabled, so tlb shootdowns are answered
+    auto& core = *get_current_cpu();
     while (true) {
         cli();
-        hlt();
+        uint64_t generation = call_generation;
+        if (call_seen[core.os_id] == generation) {
+            // sti only takes effect after hlt, so a call interrupt in between still wakes the core
+            asm volatile("sti; hlt");
+            continue;
+        }
+        sti();
+        call_seen[core.os_id] = generation;
+        call_job(call_data);
+        __atomic_sub_fetch(&call_pending, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static volatile uint64_t mismatched_cores = 0;
+
+static void check_cpu_local(void*) {
+    auto* local = get_cpu_local();
+    if (!local || local->self != local || local->core != &find_current_core() || get_cpu_number() != local->core->os_id) {
+        __atomic_add_fetch(&mismatched_cores, 1, __ATOMIC_RELAXED);
+    }
+}
+
+Test::Result test() {
+    mismatched_cores = 0;
+    run_on_all_cores(check_cpu_local, nullptr);
+    if (mismatched_cores) return Test::Result::failure("a core found the block of another core through gs");
+    // the first run fills the caches, the second one measures
+    constexpr size_t count = 1024;
+    volatile uint64_t sink = 0;
+    uint64_t local_cycles = 0;
+    uint64_t search_cycles = 0;
+    for (int run = 0; run < 2; ++run) {
+        uint64_t start = rdtsc();
+        for (size_t i = 0; i < count; ++i) {
+            sink = get_cpu_number();
+        }
+        local_cycles = (rdtsc() - start) / count;
+        start = rdtsc();
+        for (size_t i = 0; i < count; ++i) {
+            sink = find_current_core().os_id;
+        }
+        search_cycles = (rdtsc() - start) / count;
     }
+    Log::printf(Log::Info, "APIC", "current cpu: %i cycles through gs, %i cycles with the apic id search\n", local_cycles, search_cycles);
+    return Test::Result::success();
 }
 
 }// namespace APIC
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "data/btree.h"
 #include "data/pair.h"
 #include "features/bytes.h"
+#include "features/lock.h"
 #include "features/string.h"
 
 namespace PCI {
@@ -443,6 +444,8 @@ const char* generic_device::human_readable_class() const {
 }
 
 static bool pci_has_init;
+// guards pci_bar_memory and pci_bar_memory_next, every driver looks its bars up while only the first lookup of a bar writes
+static rwlock pci_bar_lock{"pci bars"};
 static btree_map<uint64_t, device_header::BAR>* pci_bar_memory;
 static VirtualAddress pci_bar_memory_next;
 static void init() {
@@ -454,11 +457,20 @@ static void init() {
 
 VirtualAddress allocate_uncached_virtual(size_t count) {
     init();
+    lock_guard guard(pci_bar_lock);
     auto address = pci_bar_memory_next;
     pci_bar_memory_next += count * page_size;
     return address;
 }
 
+// the bar is mapped before the lock is taken, a core that lost the race to another one uses its mapping and leaves its own unused
+static device_header::BAR cache_bar(uint64_t bar, const device_header::BAR& mapped) {
+    lock_guard guard(pci_bar_lock);
+    if (auto cached = pci_bar_memory->find(bar)) return cached.value();
+    pci_bar_memory->insert(bar, mapped);
+    return mapped;
+}
+
 optional<device_header::BAR> device_header::getBAR(size_t index) const {
     init();
     uint64_t bar = getBARRaw(index);
@@ -468,9 +480,12 @@ optional<device_header::BAR> device_header::getBAR(size_t index) const {
         bar |= static_cast<uint64_t>(getBARRaw(index + 1)) << 32;
     }
 
-    auto bar_cache = pci_bar_memory->find(bar);
-    if (bar_cache.has_value()) {
-        return bar_cache.value();
+    {
+        read_guard guard(pci_bar_lock);
+        auto bar_cache = pci_bar_memory->find(bar);
+        if (bar_cache.has_value()) {
+            return bar_cache.value();
+        }
     }
     auto size_opt = getBARSize(index);
     if (!size_opt.has_value()) return {};
@@ -478,8 +493,7 @@ optional<device_header::BAR> device_header::getBAR(size_t index) const {
     if (bar & 0b1) {
         // io bar
         BAR result(static_cast<uint16_t>(bar & ~0b11), size);
-        pci_bar_memory->insert(bar, result);
-        return result;
+        return cache_bar(bar, result);
     } else {
         bool prefetchable = false;
 
@@ -497,11 +511,10 @@ optional<device_header::BAR> device_header::getBAR(size_t index) const {
         } else {
             auto page_count = (size + page_size - 1) / page_size;
             auto address = allocate_uncached_virtual(page_count);
-            PageTable::map(PhysicalAddress{physical_address}, address, {.writeable = true, .user = false, .writeThrough = true, .cacheDisabled = true});
+            PageTable::map_range(PhysicalAddress{physical_address}, address, page_count * page_size, {.writeable = true, .user = false, .writeThrough = true, .cacheDisabled = true, .global = true});
             res = BAR(address, size);
         }
-        pci_bar_memory->insert(bar, res);
-        return res;
+        return cache_bar(bar, res);
     }
 }
 optional<size_t> device_header::getBARSize(size_t index) const {
@@ -516,7 +529,7 @@ optional<size_t> device_header::getBARSize(size_t index) const {
         *(ptr + 1) = ~static_cast<uint32_t>(0);
     }
     *ptr = ~static_cast<uint32_t>(0);
-    flush_cache();
+    clflush(ptr);
     uint64_t size = *ptr;
     if (bar & 0b1) {
         // IO
@@ -533,7 +546,7 @@ optional<size_t> device_header::getBARSize(size_t index) const {
         *(ptr + 1) = static_cast<uint32_t>(bar >> 32);
     }
     *ptr = static_cast<uint32_t>(bar);
-    flush_cache();
+    clflush(ptr);
     if (size == 0) return {};
     size = ~size + 1;
     if ((bar & 0b111) != 0b100) {
@@ -42,7 +42,6 @@ struct sata_port_device : file::device::implementation {
             if(!port->wait_for(res.value())) {
                 return file::device::error_t::DEVICE_UNAVAILABLE;
             }
-            flush_cache();
             return size;
         }
 
@@ -57,7 +56,6 @@ struct sata_port_device : file::device::implementation {
                 return file::device::error_t::DEVICE_UNAVAILABLE;
             }
             memcpy(buffer, sector_buffer + (offset % port->sector_size) / 2, size);
-            flush_cache();
             return size;
         }
 
@@ -72,7 +70,6 @@ struct sata_port_device : file::device::implementation {
                 return file::device::error_t::DEVICE_UNAVAILABLE;
             }
             memcpy(buffer, sector_buffer + (offset % port->sector_size) / 2, size);
-            flush_cache();
             return size;
         }
 
@@ -129,7 +126,6 @@ struct sata_port_device : file::device::implementation {
         memcpy(buffer, regions[0].buffer + (regions[0].offset % port->sector_size) / 2, regions[0].size);
         memcpy(static_cast<uint16_t*>(buffer) + regions[0].size / 2 + regions[1].size / 2, regions[2].buffer, regions[2].size);
 
-        flush_cache();
         return size;
     }
 
@@ -158,7 +154,6 @@ struct sata_port_device : file::device::implementation {
             if(!port->wait_for(res.value())) {
                 return file::device::error_t::DEVICE_UNAVAILABLE;
             }
-            flush_cache();
             return size;
         }
 
@@ -180,7 +175,6 @@ struct sata_port_device : file::device::implementation {
             if(!port->wait_for(res.value())) {
                 return file::device::error_t::DEVICE_UNAVAILABLE;
             }
-            flush_cache();
             return size;
         }
 
@@ -202,7 +196,6 @@ struct sata_port_device : file::device::implementation {
             if(!port->wait_for(res.value())) {
                 return file::device::error_t::DEVICE_UNAVAILABLE;
             }
-            flush_cache();
             return size;
         }
 
@@ -279,7 +272,6 @@ struct sata_port_device : file::device::implementation {
             return error.value();
         }
 
-        flush_cache();
         return size;
     }
 };
@@ -356,6 +348,8 @@ void PCI::Sata::init() {
         if (port->has_device && !port->is_atapi) {
             // register as device
             shared_ptr<Port> port_ptr = shared_ptr<Port>(port.value());
+            // devices are never removed, so the copy behind port_ptr is the final storage of the port
+            port_ptr->name_lock();
             file::push_device({port_ptr->sector_size * port_ptr->sector_count,
                                new sata_port_device(port_ptr)});
         }
@@ -369,9 +363,7 @@ void PCI::Sata::Port::init() {
     stop();
     PhysicalAddress ppage = PhysicalAllocator::alloc(page_count_per_port).value_or_panic("Failed to allocate page for SATA");
     VirtualAddress vpage = PCI::allocate_uncached_virtual(page_count_per_port);
-    for (size_t i = 0; i < page_count_per_port; ++i) {
-        PageTable::map(ppage.address + i * page_size, vpage + i * page_size, {.writeable = true, .user = false, .writeThrough = false, .cacheDisabled = true});
-    }
+    PageTable::map_range(ppage, vpage, page_count_per_port * page_size, {.writeable = true, .user = false, .writeThrough = false, .cacheDisabled = true, .global = true});
     memset(vpage.as<void*>(), 0, page_count_per_port * page_size);
 
     command_list_ptr = vpage.as<volatile command_list*>();
@@ -514,6 +506,8 @@ bool PCI::Sata::Port::wait_for(uint8_t slot) {
             return false;
         }
         if (res.value()) {
+            // dma is cache coherent, only keep the compiler and cpu from reading the buffer early
+            memory_barrier();
             return true;
         }
         asm("pause");
@@ -3,8 +3,43 @@
 //
 
 #include "features/lock.h"
+#include "ACPI/APIC.h"
+#include "asm/regs.h"
+#include "out/log.h"
+#include "test/test.h"
+
+#ifdef LOCK_STATS_CRACKOS3
+static lock_stats* registered_locks;
+
+uint64_t lock_stats::now() {
+    return rdtsc();
+}
+
+void lock_stats::acquired(uint64_t spin_start, bool was_contended) {
+    hold_start = rdtsc();
+    acquisitions++;
+    if (was_contended) {
+        contended++;
+        spin_cycles += hold_start - spin_start;
+    }
+    if (!registered && name) {
+        // other locks register at the same time
+        registered = true;
+        next_registered = __atomic_load_n(&registered_locks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&registered_locks, &next_registered, this, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    }
+}
+
+void lock_stats::released() {
+    uint64_t hold = rdtsc() - hold_start;
+    if (hold > max_hold) max_hold = hold;
+}
+#endif
 
 void spinlock::lock() {
+    // try_lock counts the uncontended acquisition
+    if (try_lock()) return;
+    uint64_t spin_start = now();
     asm volatile(R"(
     .lock_loop:
         lock btsq $0, (%0)
@@ -16,11 +51,15 @@ void spinlock::lock() {
         jmp .lock_loop
     .done:
         nop
-    )" ::"r"(&data));
+    )" ::"r"(&data)
+                 : "memory", "cc");
+    acquired(spin_start, true);
 }
 
 void spinlock::unlock() {
-    data = 0;
+    released();
+    // the stores of the section may not move behind the release
+    __atomic_store_n(&data, 0, __ATOMIC_RELEASE);
 }
 
 bool spinlock::is_locked() const {
@@ -34,6 +73,246 @@ bool spinlock::try_lock() {
     setnc %0
     )"
                  : "=r"(success)
-                 : "r"(&data));
+                 : "r"(&data)
+                 : "memory", "cc");
+    if (success) acquired(0, false);
     return success;
 }
+
+void ticket_lock::lock() {
+    uint32_t ticket = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&serving, __ATOMIC_ACQUIRE) == ticket) {
+        acquired(0, false);
+        return;
+    }
+    uint64_t spin_start = now();
+    while (__atomic_load_n(&serving, __ATOMIC_ACQUIRE) != ticket) {
+        asm volatile("pause");
+    }
+    acquired(spin_start, true);
+}
+
+void ticket_lock::unlock() {
+    released();
+    // only the holder writes serving
+    __atomic_store_n(&serving, serving + 1, __ATOMIC_RELEASE);
+}
+
+bool ticket_lock::is_locked() const {
+    return next != serving;
+}
+
+bool ticket_lock::try_lock() {
+    uint32_t ticket = __atomic_load_n(&serving, __ATOMIC_ACQUIRE);
+    uint32_t expected = ticket;
+    if (!__atomic_compare_exchange_n(&next, &expected, ticket + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return false;
+    acquired(0, false);
+    return true;
+}
+
+void mcs_lock::lock(node& self) {
+    self.next = nullptr;
+    self.waiting = true;
+    node* prev = __atomic_exchange_n(&tail, &self, __ATOMIC_ACQ_REL);
+    if (prev == nullptr) {
+        acquired(0, false);
+        return;
+    }
+    uint64_t spin_start = now();
+    __atomic_store_n(&prev->next, &self, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&self.waiting, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+    acquired(spin_start, true);
+}
+
+void mcs_lock::unlock(node& self) {
+    released();
+    node* next = __atomic_load_n(&self.next, __ATOMIC_ACQUIRE);
+    if (next == nullptr) {
+        node* expected = &self;
+        if (__atomic_compare_exchange_n(&tail, &expected, nullptr, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+        // a waiter already swapped itself into tail but has not linked to this node yet
+        while ((next = __atomic_load_n(&self.next, __ATOMIC_ACQUIRE)) == nullptr) {
+            asm volatile("pause");
+        }
+    }
+    __atomic_store_n(&next->waiting, false, __ATOMIC_RELEASE);
+}
+
+bool mcs_lock::is_locked() const {
+    return tail != nullptr;
+}
+
+void rwlock::lock() {
+    if (try_lock()) return;
+    uint64_t spin_start = now();
+    while (true) {
+        uint32_t current = __atomic_load_n(&state, __ATOMIC_RELAXED);
+        // the bit of a waiting writer is dropped by whichever writer gets the lock, the others set it again
+        if ((current & ~writer_waiting) == 0) {
+            if (__atomic_compare_exchange_n(&state, &current, writer, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+            continue;
+        }
+        if (!(current & writer_waiting)) __atomic_fetch_or(&state, writer_waiting, __ATOMIC_RELAXED);
+        asm volatile("pause");
+    }
+    acquired(spin_start, true);
+}
+
+void rwlock::unlock() {
+    released();
+    __atomic_fetch_and(&state, ~writer, __ATOMIC_RELEASE);
+}
+
+bool rwlock::try_lock() {
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&state, &expected, writer, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return false;
+    acquired(0, false);
+    return true;
+}
+
+void rwlock::lock_shared() {
+    while (!try_lock_shared()) {
+        asm volatile("pause");
+    }
+}
+
+void rwlock::unlock_shared() {
+    __atomic_fetch_sub(&state, 1, __ATOMIC_RELEASE);
+}
+
+bool rwlock::try_lock_shared() {
+    uint32_t current = __atomic_load_n(&state, __ATOMIC_RELAXED);
+    if (current & (writer | writer_waiting)) return false;
+    return __atomic_compare_exchange_n(&state, &current, current + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+bool rwlock::is_locked() const {
+    return (state & ~writer_waiting) != 0;
+}
+
+uint64_t seqlock::read_begin() const {
+    uint64_t start;
+    while ((start = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE)) & 1) {
+        asm volatile("pause");
+    }
+    return start;
+}
+
+bool seqlock::read_retry(uint64_t start) const {
+    // the reads of the section may not move behind the check
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sequence, __ATOMIC_RELAXED) != start;
+}
+
+void seqlock::lock() {
+    writers.lock();
+    __atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELAXED);
+    // the writes of the section may not move before the odd sequence
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seqlock::unlock() {
+    __atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELEASE);
+    writers.unlock();
+}
+
+namespace locks {
+
+template<typename LOCK_T>
+struct contention {
+    LOCK_T lock{"benchmark"};
+    volatile uint64_t counter = 0;
+    uint64_t iterations = 0;
+};
+
+template<typename LOCK_T>
+static contention<LOCK_T> contention_run;
+
+template<typename LOCK_T>
+static void contend(void* data) {
+    auto& run = *static_cast<contention<LOCK_T>*>(data);
+    for (uint64_t i = 0; i < run.iterations; ++i) {
+        lock_guard guard(run.lock);
+        run.counter = run.counter + 1;
+    }
+}
+
+// cycles per acquisition, 0 if the lock let two cores into the section
+template<typename LOCK_T>
+static uint64_t measure(uint64_t iterations) {
+    auto& run = contention_run<LOCK_T>;
+    run.counter = 0;
+    run.iterations = iterations;
+    uint64_t start = rdtsc();
+    APIC::run_on_all_cores(contend<LOCK_T>, &run);
+    uint64_t cycles = rdtsc() - start;
+    uint64_t acquisitions = iterations * APIC::get_online_core_count();
+    if (run.counter != acquisitions) return 0;
+    return cycles / acquisitions;
+}
+
+Test::Result test() {
+    // the test locks are static, so a build with lock statistics never collects a lock that went out of scope
+    {
+        static ticket_lock lock;
+        lock.lock();
+        if (!lock.is_locked() || lock.try_lock()) return Test::Result::failure("ticket lock was taken twice");
+        lock.unlock();
+        if (lock.is_locked() || !lock.try_lock()) return Test::Result::failure("ticket lock was not released");
+        lock.unlock();
+    }
+    {
+        static mcs_lock lock;
+        {
+            lock_guard guard(lock);
+            if (!lock.is_locked()) return Test::Result::failure("mcs lock was not taken");
+        }
+        if (lock.is_locked()) return Test::Result::failure("mcs lock was not released");
+    }
+    {
+        static rwlock lock;
+        {
+            read_guard first(lock);
+            read_guard second(lock);
+            if (lock.try_lock()) return Test::Result::failure("rwlock let a writer in next to readers");
+        }
+        lock.lock();
+        if (lock.try_lock_shared()) return Test::Result::failure("rwlock let a reader in next to a writer");
+        lock.unlock();
+        if (lock.is_locked()) return Test::Result::failure("rwlock was not released");
+    }
+    {
+        static seqlock lock;
+        uint64_t start = lock.read_begin();
+        if (lock.read_retry(start)) return Test::Result::failure("seqlock failed a read without a writer");
+        {
+            lock_guard guard(lock);
+        }
+        if (!lock.read_retry(start)) return Test::Result::failure("seqlock missed a write");
+    }
+    constexpr uint64_t iterations = 10000;
+    uint64_t spin = measure<spinlock>(iterations);
+    uint64_t ticket = measure<ticket_lock>(iterations);
+    uint64_t mcs = measure<mcs_lock>(iterations);
+    if (spin == 0 || ticket == 0 || mcs == 0) return Test::Result::failure("lock let two cores into the section");
+    Log::printf(Log::Info, "locks", "%i cores: %i cycles per spinlock, %i per ticket lock, %i per mcs lock acquisition\n",
+                APIC::get_online_core_count(), spin, ticket, mcs);
+    print_stats();
+    return Test::Result::success();
+}
+
+void print_stats() {
+#ifdef LOCK_STATS_CRACKOS3
+    // counters of locks held right now may be in the middle of an update, that only skews one line
+    for (auto* stats = __atomic_load_n(&registered_locks, __ATOMIC_ACQUIRE); stats; stats = stats->next_registered) {
+        Log::printf(Log::Info, "locks", "%s (%x): %i acquisitions, %i contended, %i spin cycles, max hold %i cycles\n",
+                    stats->name, stats, stats->acquisitions, stats->contended, stats->spin_cycles, stats->max_hold);
+    }
+#else
+    Log::printf(Log::Info, "locks", "lock statistics need a build with LOCK_STATS_CRACKOS3\n");
+#endif
+}
+
+}// namespace locks
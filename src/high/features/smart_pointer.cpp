@@ -0,0 +1,82 @@
+#include "features/smart_pointer.h"
+#include "ACPI/APIC.h"
+#include "test/test.h"
+
+namespace smart_pointers {
+
+struct tracked : ref_counted {
+    static uint64_t destroyed;
+    ~tracked() {
+        __atomic_fetch_add(&destroyed, 1, __ATOMIC_RELAXED);
+    }
+};
+uint64_t tracked::destroyed = 0;
+
+struct race {
+    shared_ptr<tracked> shared;
+    weak_ptr<tracked> weak;
+    intrusive_ptr<tracked> intrusive;
+    shared_ptr<tracked>* last_copies;// one per core, the cores release them at the same time
+    bool failed;
+};
+
+static constexpr uint64_t iterations = 1000;
+
+static void copy_and_release(void* data) {
+    auto& run = *static_cast<race*>(data);
+    for (uint64_t i = 0; i < iterations; ++i) {
+        shared_ptr<tracked> copy = run.shared;
+        auto locked = run.weak.lock();
+        intrusive_ptr<tracked> intrusive = run.intrusive;
+        if (!copy || !locked || !intrusive) __atomic_store_n(&run.failed, true, __ATOMIC_RELAXED);
+    }
+}
+
+// weak_ptr::lock on one core races with the release of the last strong reference on another
+static void release_last(void* data) {
+    auto& run = *static_cast<race*>(data);
+    for (uint64_t i = 0; i < iterations; ++i) {
+        auto locked = run.weak.lock();
+    }
+    run.last_copies[APIC::get_cpu_number()].reset();
+    for (uint64_t i = 0; i < iterations; ++i) {
+        auto locked = run.weak.lock();
+    }
+}
+
+Test::Result test() {
+    tracked::destroyed = 0;
+    race run{};
+    run.shared = shared_ptr<tracked>(new tracked());
+    auto& shared_alias = run.shared;
+    run.shared = shared_alias;
+    if (run.shared.use_count() != 1 || tracked::destroyed != 0) return Test::Result::failure("self assignment of a shared_ptr changed the count");
+    run.weak = weak_ptr<tracked>(run.shared);
+    run.intrusive = intrusive_ptr<tracked>(new tracked());
+    auto& intrusive_alias = run.intrusive;
+    run.intrusive = intrusive_alias;
+    if (run.intrusive.use_count() != 1 || tracked::destroyed != 0) return Test::Result::failure("self assignment of an intrusive_ptr changed the count");
+
+    APIC::run_on_all_cores(copy_and_release, &run);
+    if (run.failed) return Test::Result::failure("a copy made on another core was empty");
+    if (run.shared.use_count() != 1 || run.intrusive.use_count() != 1 || tracked::destroyed != 0) {
+        return Test::Result::failure("copies on several cores lost or kept a reference");
+    }
+    run.intrusive.reset();
+    if (tracked::destroyed != 1) return Test::Result::failure("intrusive_ptr did not destroy the object with its last reference");
+
+    auto cores = APIC::get_core_count();
+    run.last_copies = new shared_ptr<tracked>[cores];
+    for (size_t i = 0; i < cores; ++i) {
+        run.last_copies[i] = run.shared;
+    }
+    run.shared.reset();
+    APIC::run_on_all_cores(release_last, &run);
+    // copies of cores that are not online are released here
+    delete[] run.last_copies;
+    if (tracked::destroyed != 2) return Test::Result::failure("the last release did not destroy the object exactly once");
+    if (run.weak.lock()) return Test::Result::failure("weak_ptr revived a destroyed object");
+    return Test::Result::success();
+}
+
+}// namespace smart_pointers
@@ -13,13 +13,14 @@ optional<partition> GPT::getPartition(size_t index) {
     uint8_t buffer[partition_entry_size];
     if (dev.read(buffer, offset, partition_entry_size).has_error()) return {};
     partition partition;
-    char* name = new char[(partition_entry_size - 0x38) / 2 + 1];
-    memset(name, 0, (partition_entry_size - 0x38) / 2 + 1);
-    for (size_t i = 0; i < (partition_entry_size - 0x38) / 2; i++) {
+    // the name is kept by the partition, only the narrowed copy is scratch
+    size_t name_length = (partition_entry_size - 0x38) / 2;
+    char name[name_length];
+    for (size_t i = 0; i < name_length; i++) {
         name[i] = buffer[0x38 + i * 2];
     }
 
-    partition.name = name;
+    partition.name = string::from_char_array(name, name_length);
     memcpy(partition.type, buffer, 16);
     memcpy(partition.guid, buffer + 0x10, 16);
     partition.starting_lba = *(uint64_t*) (buffer + 0x20);
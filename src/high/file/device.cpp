@@ -3,34 +3,53 @@
 //
 
 #include "file/device.h"
-#include "data/linked_list.h"
+#include "features/lock.h"
 #include "features/string.h"
 #include "file/GPT.h"
+#include "out/panic.h"
 
 namespace file {
 
-static linked_list<device>* devices;
-static size_t size;
-static bool has_init;
-static void init() {
-    if (has_init) return;
-    has_init = true;
-    size = 0;
-    devices = new linked_list<device>();
+// devices are never removed, so an entry stays valid once a reader has seen it in the table
+struct device_table {
+    device** entries;
+    size_t count;
+};
+static seqlock devices_lock{"device list"};
+static device_table devices;
+static size_t capacity;// guarded by the writer side of devices_lock
+
+static device_table snapshot() {
+    device_table table;
+    uint64_t start;
+    do {
+        start = devices_lock.read_begin();
+        table.entries = devices.entries;
+        table.count = devices.count;
+    } while (devices_lock.read_retry(start));
+    return table;
 }
 
 void push_device(const device& dev) {
-    init();
-    devices->push_back(dev);
-    size++;
+    auto* entry = new device(dev);
+    lock_guard guard(devices_lock);
+    if (devices.count == capacity) {
+        // readers may still index the old table, it is never freed
+        capacity = capacity ? capacity * 2 : 8;
+        auto** entries = new device*[capacity];
+        memcpy(entries, devices.entries, devices.count * sizeof(device*));
+        devices.entries = entries;
+    }
+    devices.entries[devices.count] = entry;
+    devices.count++;
 }
 size_t device_count() {
-    init();
-    return size;
+    return snapshot().count;
 }
 device& get_device(size_t index) {
-    init();
-    return (*devices)[index];
+    auto table = snapshot();
+    assert(index < table.count, "device index out of bounds");
+    return *table.entries[index];
 }
 
 optional<GPT> device::find_partitions() {
@@ -6,6 +6,7 @@
 #include "data/array.h"
 #include "features/math.h"
 #include "file/partition.h"
+#include "memory/arena.h"
 #include "out/log.h"
 
 namespace file {
@@ -311,9 +312,11 @@ struct ext4_filesystem : filesystem::implementation {
             if (!is_directory()) {
                 panic("not a directory");
             }
-            unique_ptr<uint8_t> buffer(new uint8_t[get_fs()->block_size]);
+            // the block and the names are scratch, callers copy the names they keep
+            arena::scope scratch;
+            auto* buffer = static_cast<uint8_t*>(arena::allocate(get_fs()->block_size));
             for (uint64_t i = 0; i < get_size(); i += get_fs()->block_size) {
-                read(buffer.get(), i, get_fs()->block_size);
+                read(buffer, i, get_fs()->block_size);
                 for (size_t offset = 0; offset < get_fs()->block_size;) {
                     struct entry {
                         uint32_t inode;
@@ -321,15 +324,13 @@ struct ext4_filesystem : filesystem::implementation {
                         uint8_t name_length;
                         uint8_t type;
                     };
-                    auto e = reinterpret_cast<entry*>(buffer.get() + offset);
+                    auto e = reinterpret_cast<entry*>(buffer + offset);
                     offset += e->size;
                     if (e->inode == 0) {
                         continue;
                     }
-                    directory_entry de{};
-                    de.inode = e->inode;
-                    de.flags = e->type;
-                    de.name = string::from_char_array(reinterpret_cast<char*>(e + 1), e->name_length);
+                    arena::scope name_scratch;
+                    directory_entry de{e->inode, e->type, string::from_char_array(reinterpret_cast<char*>(e + 1), e->name_length, arena::allocator{})};
                     if (!c(de)) {
                         return;
                     }
@@ -20,6 +20,8 @@
 #include "interrupt/default_handler.h"
 #include "interrupt/interrupt.h"
 #include "memory/heap.h"
+#include "memory/arena.h"
+#include "memory/kmem_cache.h"
 #include "memory/mem.h"
 #include "memory/paging.h"
 #include "out/log.h"
@@ -54,6 +56,7 @@ struct Main {
 
     void init(PhysicalAddress header) {
         multiboot_header = header;
+        APIC::init_cpu_local();
         PhysicalAllocator::init(multiboot_header);
         PageTable::init();
         VGA::Text::init();
@@ -136,12 +139,14 @@ struct Main {
         kernel_process->add_kernel_method("printStr", VirtualAddress(static_cast<void(*)(char*)>(print)), proc::process::method_descriptor::c_string);
         kernel_process->add_kernel_method("printInt", VirtualAddress(static_cast<void(*)(uint64_t)>(print)), proc::process::method_descriptor::uint64);
         kernel_process->add_kernel_method("panic", VirtualAddress(panic), proc::process::method_descriptor::c_string);
+        kernel_process->add_kernel_method("printFaultCounters", VirtualAddress(static_cast<void(*)()>(proc::print_fault_counters)));
+#ifdef LOCK_STATS_CRACKOS3
+        kernel_process->add_kernel_method("printLockStats", VirtualAddress(locks::print_stats));
+#endif
 
         for(auto& fs : filesystems) {
-            auto file = fs.open("/main");
-            auto process = proc::from_elf(file);
-            kernel_process->children.push_back(process);
-            process->parent = kernel_process;
+            auto process = proc::from_elf(new file::file(fs.open("/main")));
+            kernel_process->add_child(process);
             process->main_thread.execute();
         }
     }
@@ -155,7 +160,14 @@ extern "C" [[noreturn]] void high_main(PhysicalAddress multiboot_header) {
     main->init(multiboot_header);
     Log::printf(Log::Info, "Main", "Everything initialized\n");
 #ifdef TEST_CRACKOS3
+    Test::run_test("PhysicalAllocator", PhysicalAllocator::test);
+    Test::run_test("PageTable", PageTable::test);
     Test::run_test("kheap", kheap::test);
+    Test::run_test("kmem_cache", kmem::test);
+    Test::run_test("arena", arena::test);
+    Test::run_test("APIC", APIC::test);
+    Test::run_test("locks", locks::test);
+    Test::run_test("smart pointers", smart_pointers::test);
     Test::run_test("btree", btree<int>::test);
 #endif
     main->loop();
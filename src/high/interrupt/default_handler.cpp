@@ -3,6 +3,7 @@
 //
 
 #include "interrupt/default_handler.h"
+#include "ACPI/APIC.h"
 #include "asm/regs.h"
 #include "memory/paging.h"
 #include "out/log.h"
@@ -40,12 +41,18 @@ static const char* get_name(uint8_t number) {
         return "Unknown";
     }
 }
-static bool page_fault_recursion_stop;
+// page faults are routine with demand paging, so every core has its own flag, the boot core uses this one until the cores are known
+static bool boot_in_page_fault;
+static Interrupt::page_fault_resolver_t page_fault_resolver = nullptr;
+
+void Interrupt::set_page_fault_resolver(page_fault_resolver_t resolver) {
+    page_fault_resolver = resolver;
+}
 
 static void trace_page_fault(VirtualAddress address) {
     Log::printf(Log::Warning, "PageFault", "Try to trace address %x %x %x %x %x\n", address.l4Offset,
                 address.l3Offset, address.l2Offset, address.l1Offset, address.offset);
-    auto* page = PhysicalAddress(getCR3()).mapTmp().as<PageTable::PageTable*>();
+    auto* page = PhysicalAddress{PageTable::current_address_space().address & ~(page_size - 1)}.mapTmp().as<PageTable::PageTable*>();
     uint8_t level4 = address.l4Offset;
     auto entry = page->entries[level4];
     Log::printf(Log::Error, "PageFault", "Level 4 Page at %x: entry[%i] = %x\n", page, level4, entry.raw);
@@ -61,6 +68,10 @@ static void trace_page_fault(VirtualAddress address) {
         Log::printf(Log::Error, "PageFault", "Link to level 2 page not present\n");
         return;
     }
+    if (entry.pageSize) {
+        Log::printf(Log::Error, "PageFault", "    Physical 1GiB Page %x", entry.address().address);
+        return;
+    }
     page = entry.address().mapTmp().as<PageTable::PageTable*>();
     uint8_t level2 = address.l2Offset;
     entry = page->entries[level2];
@@ -69,6 +80,10 @@ static void trace_page_fault(VirtualAddress address) {
         Log::printf(Log::Error, "PageFault", "Link to level 1 page not present\n");
         return;
     }
+    if (entry.pageSize) {
+        Log::printf(Log::Error, "PageFault", "    Physical 2MiB Page %x", entry.address().address);
+        return;
+    }
     page = entry.address().mapTmp().as<PageTable::PageTable*>();
     uint8_t level1 = address.l1Offset;
     entry = page->entries[level1];
@@ -80,12 +95,22 @@ static void trace_page_fault(VirtualAddress address) {
     Log::printf(Log::Error, "PageFault", "    Physical Page %x", entry.address().address);
 }
 
+static bool& in_page_fault() {
+    auto* local = APIC::get_cpu_local();
+    return local ? local->in_page_fault : boot_in_page_fault;
+}
+
 void page_fault_handler(uint8_t, uint64_t error, void* stack, void*) {
-    if (page_fault_recursion_stop) {
+    auto& recursion_stop = in_page_fault();
+    if (recursion_stop) {
         panic("Page fault in page fault handler");
     }
-    page_fault_recursion_stop = true;
+    recursion_stop = true;
     uint64_t address = getCR2();
+    if (page_fault_resolver && page_fault_resolver(VirtualAddress(address), error)) {
+        recursion_stop = false;
+        return;
+    }
     bool present = error & (1 << 0);
     bool write = error & (1 << 1);
     bool user = error & (1 << 2);
@@ -123,6 +148,6 @@ void Interrupt::init_default_handlers() {
             Log::printf(Log::Fatal, "Interrupt", "Unhandled interrupt %i (%s)\n", number, get_name(number));
         });
     }
-    page_fault_recursion_stop = false;
+    boot_in_page_fault = false;
     registerHandler(14, page_fault_handler);
 }
\ No newline at end of file
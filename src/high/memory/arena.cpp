@@ -0,0 +1,156 @@
+#include "memory/arena.h"
+#include "ACPI/APIC.h"
+#include "asm/regs.h"
+#include "asm/util.h"
+#include "data/linked_list.h"
+#include "data/string.h"
+#include "features/bytes.h"
+#include "memory/heap.h"
+#include "out/log.h"
+
+namespace arena {
+
+// chunks are never given back, an arena keeps as much memory as the largest operation on its cpu needed
+struct chunk {
+    chunk* prev;
+    chunk* next;// chunks behind the current one are free
+    size_t size;// usable bytes behind the header
+};
+
+struct cpu_arena {
+    chunk* first;
+    chunk* current;// nullptr before the first allocation or after a scope that started before it ended
+    size_t offset; // first free byte in current
+};
+
+static constexpr size_t chunk_size = 64_Ki;
+static constexpr size_t no_fit = ~0ull;
+// apic ids are 8 bit, so this covers every core initLocalAPIC can bring up
+static constexpr size_t max_cpu_count = 256;
+static cpu_arena arenas[max_cpu_count];
+
+// before the cores are known only the boot processor runs
+static cpu_arena& current_arena() {
+    return arenas[APIC::get_cpu_number()];
+}
+
+static uint8_t* data_of(chunk* c) {
+    return reinterpret_cast<uint8_t*>(c + 1);
+}
+
+// offset of size bytes at the alignment behind offset in c, no_fit if they do not fit
+static size_t fit(chunk* c, size_t offset, size_t size, size_t alignment) {
+    auto base = reinterpret_cast<uint64_t>(data_of(c));
+    size_t start = ((base + offset + alignment - 1) & ~(alignment - 1)) - base;
+    return start + size <= c->size ? start : no_fit;
+}
+
+void* allocate(size_t size, size_t alignment) {
+    // interrupt handlers of this cpu use the same arena
+    auto flags = getFlags();
+    cli();
+    auto& arena = current_arena();
+    size_t start = arena.current ? fit(arena.current, arena.offset, size, alignment) : no_fit;
+    if (start == no_fit) {
+        chunk* next = arena.current ? arena.current->next : arena.first;
+        if (next == nullptr || fit(next, 0, size, alignment) == no_fit) {
+            // the heap is called with the interrupts of the caller, an interrupt in between ends its scopes before returning
+            setFlags(flags);
+            size_t bytes = size + alignment > chunk_size ? size + alignment : chunk_size;
+            auto* fresh = static_cast<chunk*>(kmalloc(sizeof(chunk) + bytes));
+            if (fresh == nullptr) return nullptr;
+            fresh->size = bytes;
+            cli();
+            next = arena.current ? arena.current->next : arena.first;
+            fresh->prev = arena.current;
+            fresh->next = next;
+            if (next) next->prev = fresh;
+            if (arena.current) {
+                arena.current->next = fresh;
+            } else {
+                arena.first = fresh;
+            }
+            next = fresh;
+        }
+        arena.current = next;
+        start = fit(next, 0, size, alignment);
+    }
+    arena.offset = start + size;
+    void* result = data_of(arena.current) + start;
+    setFlags(flags);
+    return result;
+}
+
+scope::scope() {
+    auto flags = getFlags();
+    cli();
+    owner = &current_arena();
+    start_chunk = owner->current;
+    start_offset = owner->offset;
+    setFlags(flags);
+}
+
+scope::~scope() {
+    auto flags = getFlags();
+    cli();
+    owner->current = start_chunk;
+    owner->offset = start_offset;
+    setFlags(flags);
+}
+
+Test::Result test() {
+    {
+        scope outer;
+        auto* ptr1 = allocate(100);
+        if (ptr1 == nullptr) return Test::Result::failure("arena failed to allocate memory");
+        void* ptr2;
+        {
+            scope inner;
+            ptr2 = allocate(100);
+            auto* large = static_cast<uint8_t*>(allocate(3 * chunk_size, page_size));
+            if (large == nullptr) return Test::Result::failure("arena failed to allocate more than a chunk");
+            if (reinterpret_cast<uint64_t>(large) % page_size != 0) return Test::Result::failure("arena ignored the alignment");
+            large[3 * chunk_size - 1] = 1;
+        }
+        if (allocate(100) != ptr2) return Test::Result::failure("end of a scope did not free its memory");
+        {
+            scope inner;
+            linked_list<uint64_t, allocator> list;
+            for (uint64_t i = 0; i < 1000; ++i) {
+                list.push_back(i);
+            }
+            if (list.size != 1000 || list[999] != 999) return Test::Result::failure("linked_list in the arena lost elements");
+            auto name = string::from_char_array("scratch", 7, allocator{});
+            if (name != string("scratch")) return Test::Result::failure("string in the arena has the wrong content");
+        }
+    }
+    {
+        // the first run fills the arena and the heap caches, the second one measures
+        constexpr size_t count = 1024;
+        static void* objects[count];
+        uint64_t arena_cycles = 0;
+        uint64_t heap_cycles = 0;
+        for (int run = 0; run < 2; ++run) {
+            uint64_t start = rdtsc();
+            {
+                scope s;
+                for (auto& object : objects) {
+                    object = allocate(64);
+                }
+            }
+            arena_cycles = (rdtsc() - start) / count;
+            start = rdtsc();
+            for (auto& object : objects) {
+                object = kmalloc(64);
+            }
+            for (auto& object : objects) {
+                kfree(object);
+            }
+            heap_cycles = (rdtsc() - start) / count;
+        }
+        Log::printf(Log::Info, "arena", "64 bytes: %i cycles in the arena, %i cycles with malloc and free\n", arena_cycles, heap_cycles);
+    }
+    return Test::Result::success();
+}
+
+}// namespace arena
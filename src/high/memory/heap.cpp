@@ -1,17 +1,21 @@
 #include "memory/heap.h"
+#include "ACPI/APIC.h"
 #include "asm/regs.h"
+#include "asm/util.h"
 #include "data/btree.h"
 #include "features/bytes.h"
 #include "features/lock.h"
 #include "features/smart_pointer.h"
 #include "memory/mem.h"
 #include "memory/paging.h"
+#include "out/log.h"
 
 namespace page_allocator {
 static void init();
 static void* malloc(size_t size);
 static void free(void* ptr);
 static size_t size(void* ptr);
+static void add_stats(kheap::Stats& stats);
 }// namespace page_allocator
 
 namespace small_allocator {
@@ -19,6 +23,8 @@ static void init();
 static void* malloc(size_t size);
 static void free(void* ptr);
 static size_t size(void* ptr);
+static const char* test_remote_free();
+static void add_stats(kheap::Stats& stats);
 }// namespace small_allocator
 
 namespace large_allocator {
@@ -26,17 +32,61 @@ static void init();
 static void* malloc(size_t size);
 static void free(void* ptr);
 static size_t size(void* ptr);
+static bool resize(void* ptr, size_t size);
+static void add_stats(kheap::Stats& stats);
 }// namespace large_allocator
 
 namespace kheap {
 
-void* malloc(size_t size) {
+// hash table of sampled callers, a caller keeps its slot until the kernel restarts
+struct Sample {
+    void* caller;
+    uint64_t count;
+    uint64_t bytes;
+};
+static constexpr size_t sample_slots = 64;
+static Sample samples[sample_slots];
+static uint64_t samples_dropped;
+static uint64_t sample_interval;
+static uint64_t sample_counter;
+static ticket_lock sample_lock{"heap samples"};
+
+static void sample(void* caller, size_t size, uint64_t interval) {
+    if (__atomic_add_fetch(&sample_counter, 1, __ATOMIC_RELAXED) % interval != 0) return;
+    auto flags = getFlags();
+    cli();
+    sample_lock.lock();
+    size_t slot = (reinterpret_cast<uint64_t>(caller) * 0x9E3779B97F4A7C15) >> 58;
+    static_assert(sample_slots == 64, "the slot is taken from the top 6 bits of the hash");
+    bool recorded = false;
+    for (size_t i = 0; i < sample_slots && !recorded; ++i) {
+        auto& entry = samples[(slot + i) % sample_slots];
+        if (entry.caller == nullptr) entry.caller = caller;
+        if (entry.caller == caller) {
+            entry.count++;
+            entry.bytes += size;
+            recorded = true;
+        }
+    }
+    if (!recorded) samples_dropped++;
+    sample_lock.unlock();
+    setFlags(flags);
+}
+
+// caller is the code that asked for the memory, operator new passes its own caller
+static void* allocate(size_t size, void* caller) {
+    if (auto interval = __atomic_load_n(&sample_interval, __ATOMIC_RELAXED)) {
+        sample(caller, size, interval);
+    }
     auto res = small_allocator::malloc(size);
     if (res) return res;
     res = page_allocator::malloc(size);
     if (res) return res;
     return large_allocator::malloc(size);
 }
+void* malloc(size_t size) {
+    return allocate(size, __builtin_return_address(0));
+}
 void free(void* ptr) {
     auto addr = VirtualAddress(ptr);
     if (addr.address < 96_Ti) return;
@@ -49,6 +99,29 @@ void free(void* ptr) {
         large_allocator::free(ptr);
     }
 }
+void* realloc(void* ptr, size_t size) {
+    if (ptr == nullptr) return allocate(size, __builtin_return_address(0));
+    if (size == 0) {
+        free(ptr);
+        return nullptr;
+    }
+    auto addr = VirtualAddress(ptr);
+    if (addr.address < 96_Ti) return nullptr;
+    size_t old_size;
+    if (addr.address - 96_Ti < 20_Ti) {
+        // pages and size classes can not grow, but a smaller request still fits
+        old_size = addr.address - 96_Ti < 10_Ti ? page_allocator::size(ptr) : small_allocator::size(ptr);
+        if (size <= old_size) return ptr;
+    } else {
+        if (large_allocator::resize(ptr, size)) return ptr;
+        old_size = large_allocator::size(ptr);
+    }
+    auto* res = allocate(size, __builtin_return_address(0));
+    if (res == nullptr) return nullptr;
+    memcpy(res, ptr, old_size < size ? old_size : size);
+    free(ptr);
+    return res;
+}
 optional<size_t> get_size(void* ptr) {
     auto addr = VirtualAddress(ptr);
     if (addr.address < 96_Ti) return {};
@@ -62,6 +135,78 @@ optional<size_t> get_size(void* ptr) {
     }
 }
 
+Stats stats() {
+    Stats total{};
+    small_allocator::add_stats(total);
+    page_allocator::add_stats(total);
+    large_allocator::add_stats(total);
+    {
+        auto flags = getFlags();
+        cli();
+        sample_lock.lock();
+        for (auto& entry : samples) {
+            total.sampled += entry.count;
+        }
+        total.sampled += samples_dropped;
+        sample_lock.unlock();
+        setFlags(flags);
+    }
+    return total;
+}
+
+void print_stats() {
+    // the rates are measured between two reports
+    static Stats last;
+    static uint64_t last_time;
+    auto current = stats();
+    uint64_t now = rdtsc();
+    uint64_t mcycles = (now - last_time) / 1000000;
+    if (mcycles == 0) mcycles = 1;
+    for (size_t i = 0; i < small_class_count; ++i) {
+        auto& c = current.classes[i];
+        if (c.allocs == 0) continue;
+        Log::printf(Log::Info, "kheap", "%i bytes: %i live in %i pages, %i bytes lost to rounding, %i allocs and %i frees per Mcycle\n",
+                    c.size, c.live, c.pages, c.wasted, (c.allocs - last.classes[i].allocs) / mcycles, (c.frees - last.classes[i].frees) / mcycles);
+    }
+    Log::printf(Log::Info, "kheap", "page allocator: %i pages, %i page tables\n", current.pages, current.page_tables);
+    Log::printf(Log::Info, "kheap", "large allocator: %i regions with %i bytes, %i free extents, %i allocs and %i frees per Mcycle\n",
+                current.large_regions, current.large_bytes, current.large_free_extents,
+                (current.large_allocs - last.large_allocs) / mcycles, (current.large_frees - last.large_frees) / mcycles);
+    last = current;
+    last_time = now;
+}
+
+void set_sampling(uint64_t interval) {
+    __atomic_store_n(&sample_interval, interval, __ATOMIC_RELAXED);
+}
+
+void print_samples(size_t count) {
+    Sample sorted[sample_slots];
+    uint64_t dropped;
+    {
+        auto flags = getFlags();
+        cli();
+        sample_lock.lock();
+        memcpy(sorted, samples, sizeof(samples));
+        dropped = samples_dropped;
+        sample_lock.unlock();
+        setFlags(flags);
+    }
+    // insertion sort, most sampled first
+    for (size_t i = 1; i < sample_slots; ++i) {
+        auto entry = sorted[i];
+        size_t j = i;
+        for (; j > 0 && sorted[j - 1].count < entry.count; --j) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = entry;
+    }
+    for (size_t i = 0; i < count && i < sample_slots && sorted[i].caller; ++i) {
+        Log::printf(Log::Info, "kheap", "%p: %i samples, %i bytes\n", sorted[i].caller, sorted[i].count, sorted[i].bytes);
+    }
+    if (dropped) Log::printf(Log::Info, "kheap", "%i samples dropped, the table is full\n", dropped);
+}
+
 Test::Result test() {
     {
         auto ptr1 = static_cast<uint8_t*>(page_allocator::malloc(4096));
@@ -80,6 +225,23 @@ Test::Result test() {
         if (ptr1num != ptr2num) return Test::Result::failure("allocation after free didn't return the same pointer");
         page_allocator::free(ptr2);
     }
+    {
+        // allocation rate of the page allocator, more pages than a level 1 table holds
+        constexpr size_t count = 1024;
+        static void* pages[count];
+        uint64_t start = rdtsc();
+        for (auto& page : pages) {
+            page = page_allocator::malloc(page_size);
+            if (page == nullptr) return Test::Result::failure("page allocator failed to allocate memory");
+        }
+        for (auto& page : pages) {
+            page_allocator::free(page);
+        }
+        uint64_t cycles = rdtsc() - start;
+        if (page_allocator::malloc(page_size) != pages[0]) return Test::Result::failure("page allocator didn't reuse the lowest free page");
+        page_allocator::free(pages[0]);
+        Log::printf(Log::Info, "kheap", "page allocator: %i cycles per malloc and free of a page\n", cycles / count);
+    }
     {
         auto ptr1 = static_cast<uint8_t*>(small_allocator::malloc(12));
         auto ptr1num = reinterpret_cast<uint64_t>(ptr1);
@@ -107,6 +269,80 @@ Test::Result test() {
         if (((size_t) ptr2 & ~(page_size - 1)) != ((size_t) ptr1 & ~(page_size - 1))) return Test::Result::failure("small allocator allocated memory on different pages");
         if (dif % page_size != 0) return Test::Result::failure("small allocator allocated in wrong bucket");
     }
+    {
+        // allocation rate of the small allocator, 1024 mallocs then 1024 frees, the best run counts
+        constexpr size_t count = 1024;
+        constexpr size_t runs = 200;
+        constexpr size_t sizes[] = {4, 32, 200};
+        static void* objects[count];
+        for (auto size : sizes) {
+            uint64_t best = ~0ull;
+            for (size_t run = 0; run < runs; ++run) {
+                uint64_t start = rdtsc();
+                for (auto& object : objects) {
+                    object = small_allocator::malloc(size);
+                    if (object == nullptr) return Test::Result::failure("small allocator failed to allocate memory");
+                }
+                for (auto& object : objects) {
+                    small_allocator::free(object);
+                }
+                uint64_t cycles = rdtsc() - start;
+                if (cycles < best) best = cycles;
+            }
+            Log::printf(Log::Info, "kheap", "small allocator: %i cycles per malloc and free of %i bytes, best of %i runs\n", best / count, size, runs);
+        }
+    }
+    if (auto error = small_allocator::test_remote_free()) return Test::Result::failure(error);
+    {
+        auto* ptr1 = static_cast<uint8_t*>(large_allocator::malloc(3_Mi));
+        auto* ptr2 = static_cast<uint8_t*>(large_allocator::malloc(64_Ki));
+        if (ptr1 == nullptr || ptr2 == nullptr) return Test::Result::failure("large allocator failed to allocate memory");
+        if (reinterpret_cast<uint64_t>(ptr1) % 2_Mi != 0) return Test::Result::failure("large allocation is not 2MiB aligned");
+        ptr1[3_Mi - 1] = 1;
+        ptr2[64_Ki - 1] = 1;
+        large_allocator::free(ptr1);
+        uint64_t start = rdtsc();
+        auto* ptr3 = static_cast<uint8_t*>(large_allocator::malloc(3_Mi));
+        uint64_t cycles = rdtsc() - start;
+        large_allocator::free(ptr3);
+        large_allocator::free(ptr2);
+        if (ptr3 != ptr1) return Test::Result::failure("freed large extent was not reused");
+        Log::printf(Log::Info, "kheap", "large allocator: %i cycles to allocate 3MiB\n", cycles);
+    }
+    {
+        auto* ptr1 = static_cast<uint8_t*>(realloc(nullptr, 12));
+        if (ptr1 == nullptr) return Test::Result::failure("realloc failed to allocate memory");
+        ptr1[11] = 11;
+        if (realloc(ptr1, 16) != ptr1) return Test::Result::failure("realloc within the size class moved the memory");
+        auto* ptr2 = static_cast<uint8_t*>(realloc(ptr1, 3000));
+        if (ptr2 == nullptr || ptr2[11] != 11) return Test::Result::failure("realloc did not copy the memory");
+        auto* ptr3 = static_cast<uint8_t*>(realloc(ptr2, 64_Ki));
+        if (ptr3 == nullptr || ptr3[11] != 11) return Test::Result::failure("realloc did not copy the memory");
+        if (realloc(ptr3, 8_Ki) != ptr3 || large_allocator::size(ptr3) != 8_Ki) return Test::Result::failure("large realloc did not shrink in place");
+        // the tail given back is free behind the region
+        if (realloc(ptr3, 64_Ki) != ptr3) return Test::Result::failure("large realloc did not grow in place");
+        ptr3[64_Ki - 1] = 1;
+        if (ptr3[11] != 11) return Test::Result::failure("large realloc lost the memory");
+        free(ptr3);
+    }
+    {
+        // 100 bytes go to the 128 byte class
+        auto before = stats();
+        auto* ptr = malloc(100);
+        auto after = stats();
+        auto& was = before.classes[5];
+        auto& now = after.classes[5];
+        if (now.size != 128) return Test::Result::failure("wrong size class in the statistics");
+        if (now.allocs != was.allocs + 1 || now.live != was.live + 1 || now.wasted != was.wasted + 28) return Test::Result::failure("allocation was not counted");
+        free(ptr);
+        if (stats().classes[5].live != was.live) return Test::Result::failure("free was not counted");
+        set_sampling(1);
+        free(malloc(100));
+        set_sampling(0);
+        if (stats().sampled != after.sampled + 1) return Test::Result::failure("sampled allocation was not recorded");
+        print_stats();
+        print_samples(4);
+    }
 
     return Test::Result::success();
 }
@@ -121,144 +357,252 @@ void init() {
 
 namespace page_allocator {
 
-static constexpr uint64_t page_full_bit = 0b1;
-
-static void init() {}
-
-static void* malloc_traverse(PageTable::PageTable* pageTable, uint8_t level, VirtualAddress resAddress, VirtualAddress lowAdd = 96_Ti, VirtualAddress highAdd = 96_Ti + 10_Ti) {
-    auto low = 0;
-    auto high = 512;
-    if (level == 4) {
-        low = lowAdd.l4Offset;
-        high = highAdd.l4Offset;
-    }
-    int notFullNotEmptyNode = -1;
-    int emptyNode = -1;
-    for (auto i = low; i < high; ++i) {
-        auto& entry = pageTable->entries[i];
-        if (!entry.present && emptyNode == -1) {
-            emptyNode = i;
-        } else if (entry.present && (entry.metaData & page_full_bit) == 0) {
-            notFullNotEmptyNode = i;
-            break;
-        }
+// the heap regions are walked through the shared kernel half, every walk of the small and page heap holds it
+static spinlock lock{"page heap"};
+
+static constexpr VirtualAddress heap_start = 96_Ti;
+static constexpr VirtualAddress heap_end = 96_Ti + 20_Ti;// page heap and the slabs of the small allocator
+
+// occupancy of one page table, a set bit marks an entry that is not present or points to a table with room left
+struct Summary {
+    uint64_t not_full[8];
+    uint64_t present;// present entries, the table is freed when none are left
+};
+static_assert(sizeof(Summary) <= page_size);
+
+// the level 4 table and the level 3 tables of the kernel half are shared by all address spaces,
+// their summaries live here, every table below gets a second page with its summary
+static Summary top;
+static Summary level3[(heap_end.address - heap_start.address) / 512_Gi];
+static uint64_t page_count; // pages of the page heap, slab pages are counted by the small allocator
+static uint64_t table_count;
+
+static void init() {
+    memset(&top, 0xFF, sizeof(top.not_full));
+    for (auto& summary : level3) {
+        memset(summary.not_full, 0xFF, sizeof(summary.not_full));
+        summary.present = 512;// created by PageTable::init and never freed
     }
-    int targetNode;
-    if (notFullNotEmptyNode != -1) {
-        targetNode = notFullNotEmptyNode;
-    } else if (emptyNode != -1) {
-        targetNode = emptyNode;
-        auto& entry = pageTable->entries[targetNode];
-        auto page = PhysicalAllocator::alloc(1);
-        if (!page) return nullptr;
-        entry.addressAndReserved = (page->address) >> 12;
-        entry.present = true;
-        entry.writeEnabled = true;
-        entry.userAllowed = false;
-        entry.cacheDisabled = false;
-        entry.writeThrough = false;
-        entry.accessed = false;
-        entry.dirty = false;
-        entry.pageSize = false;
-        entry.global = false;
-        entry.metaData = 0;
-    } else {
-        return nullptr;
+}
+
+static PageTable::PageTable* table_of(const PageTable::PageTableEntry& entry) {
+    return entry.address().mapTmp().as<PageTable::PageTable*>();
+}
+
+static Summary* summary_of(const PageTable::PageTableEntry& entry) {
+    return PhysicalAddress(entry.address().address + page_size).mapTmp().as<Summary*>();
+}
+
+static int first_free(const Summary& summary, size_t low, size_t high) {
+    for (size_t word = low / 64; word * 64 < high; ++word) {
+        uint64_t bits = summary.not_full[word];
+        if (word == low / 64) bits &= ~0ull << (low % 64);
+        if ((word + 1) * 64 > high) bits &= (1ull << (high % 64)) - 1;
+        if (bits) return static_cast<int>(word * 64 + __builtin_ctzll(bits));
     }
+    return -1;
+}
 
-    auto& entry = pageTable->entries[targetNode];
-    if (level == 1) {
-        resAddress.l1Offset = targetNode;
-        auto res = resAddress.as<void*>();
-        entry.metaData |= page_full_bit;// page is allocated
-        return res;
-    } else {
-        switch (level) {
-            case 2:
-                resAddress.l2Offset = targetNode;
-                break;
-            case 3:
-                resAddress.l3Offset = targetNode;
-                break;
-            case 4:
-                resAddress.l4Offset = targetNode;
-                break;
-            default:
-                panic("invalid level in page_allocator::malloc");
-        }
-        auto nextPage = PhysicalAddress{entry.address()}.mapTmp().as<PageTable::PageTable*>();
-        auto res = malloc_traverse(nextPage, level - 1, resAddress);
-
-        bool full = true;
-        for (auto entr : nextPage->entries) {
-            if (entr.present) {
-                if (!(entr.metaData & page_full_bit)) {
-                    full = false;
-                    break;
-                }
-            } else {
-                full = false;
-                break;
-            }
-        }
-        if (full) {
-            entry.metaData |= page_full_bit;
-        }
+static bool is_full(const Summary& summary) {
+    for (auto word : summary.not_full) {
+        if (word) return false;
+    }
+    return true;
+}
+
+static void mark_full(Summary& summary, size_t index) {
+    summary.not_full[index / 64] &= ~(1ull << (index % 64));
+}
 
-        return res;
+static void mark_not_full(Summary& summary, size_t index) {
+    summary.not_full[index / 64] |= 1ull << (index % 64);
+}
+
+static void set_entry(PageTable::PageTableEntry& entry, PhysicalAddress address, bool leaf) {
+    entry.raw = 0;
+    entry.addressAndReserved = address.address >> 12;
+    entry.present = true;
+    entry.writeEnabled = true;
+    entry.global = leaf;
+}
+
+// creates the table below entry together with its summary page
+static bool create_table(PageTable::PageTableEntry& entry) {
+    auto pages = PhysicalAllocator::alloc(2);
+    if (!pages) return false;
+    memset(pages->mapTmp().as<void*>(), 0, page_size);
+    auto* summary = PhysicalAddress(pages->address + page_size).mapTmp().as<Summary*>();
+    memset(summary->not_full, 0xFF, sizeof(summary->not_full));
+    summary->present = 0;
+    set_entry(entry, *pages, false);
+    table_count++;
+    return true;
+}
+
+// summaries and entries on the way to a page of the heap, index 0 is the level 1 table
+struct Path {
+    Summary* summaries[4];
+    PageTable::PageTableEntry* entries[3];
+};
+
+// walks down to the table at level, every table on the way has to exist
+static Path walk(VirtualAddress address, uint8_t level = 1) {
+    auto* l4 = PageTable::kernel_address_space().mapTmp().as<PageTable::PageTable*>();
+    Path path{};
+    path.summaries[3] = &top;
+    path.summaries[2] = &level3[address.l4Offset - heap_start.address / 512_Gi];
+    path.entries[2] = &table_of(l4->entries[address.l4Offset])->entries[address.l3Offset];
+    if (level == 3) return path;
+    path.summaries[1] = summary_of(*path.entries[2]);
+    path.entries[1] = &table_of(*path.entries[2])->entries[address.l2Offset];
+    if (level == 2) return path;
+    path.summaries[0] = summary_of(*path.entries[1]);
+    path.entries[0] = &table_of(*path.entries[1])->entries[address.l1Offset];
+    return path;
+}
+
+// marks the slot of address in the table at level full, a table that got full with it makes its entry in the parent full
+static void mark_full_up(const Path& path, VirtualAddress address, uint8_t level) {
+    for (; level <= 4; ++level) {
+        auto& summary = *path.summaries[level - 1];
+        mark_full(summary, address.getOffset(level).value());
+        if (!is_full(summary)) return;
     }
 }
 
-static void free_traverse(PageTable::PageTable* pageTable, uint8_t level, VirtualAddress address) {
-    if (level != 1) {
-        auto& entry = pageTable->entries[address.getOffset(level).value_or_panic("invalid level in page_allocator::free")];
-        auto nextPage = entry.address().mapTmp().as<PageTable::PageTable*>();
-        free_traverse(nextPage, level - 1, address);
+static void mark_not_full_up(const Path& path, VirtualAddress address, uint8_t level) {
+    for (; level <= 4; ++level) {
+        mark_not_full(*path.summaries[level - 1], address.getOffset(level).value());
     }
+}
 
-    if (level == 1) {
-        auto& entry = pageTable->entries[address.l1Offset];
-        memset(&entry, 0, sizeof(PageTable::PageTableEntry));// clear entry
-        PhysicalAllocator::free(entry.address(), 1);
-        return;
-    } else {
-        auto& entry = pageTable->entries[address.getOffset(level).value_or_panic("invalid offset in page_allocator::free")];
-        auto nextPage = entry.address().mapTmp().as<PageTable::PageTable*>();
-
-        bool full = true;
-        bool empty = true;
-        for (auto& entr : nextPage->entries) {
-            if (entr.present) {
-                empty = false;
-                if (!(entr.metaData & page_full_bit)) {
-                    full = false;
-                }
-            } else {
-                full = false;
+// finds a free page between low and high with one find first set per level
+static void* malloc_range(VirtualAddress low, VirtualAddress high) {
+    auto* l4 = PageTable::kernel_address_space().mapTmp().as<PageTable::PageTable*>();
+    int i4 = first_free(top, low.l4Offset, high.l4Offset);
+    if (i4 < 0) return nullptr;
+    auto& s3 = level3[i4 - heap_start.address / 512_Gi];
+    auto* l3 = table_of(l4->entries[i4]);
+    int i3 = first_free(s3, 0, 512);
+    auto& e3 = l3->entries[i3];
+    if (!e3.present) {
+        if (!create_table(e3)) return nullptr;
+    }
+    auto& s2 = *summary_of(e3);
+    auto* l2 = table_of(e3);
+    int i2 = first_free(s2, 0, 512);
+    auto& e2 = l2->entries[i2];
+    if (!e2.present) {
+        if (!create_table(e2)) return nullptr;
+        s2.present++;
+    }
+    auto& s1 = *summary_of(e2);
+    auto* l1 = table_of(e2);
+    int i1 = first_free(s1, 0, 512);
+    auto page = PhysicalAllocator::alloc(1);
+    if (!page) return nullptr;
+    set_entry(l1->entries[i1], *page, true);
+    s1.present++;
+    VirtualAddress address(0, i1, i2, i3, i4);
+    mark_full_up(walk(address), address, 1);
+    return address.as<void*>();
+}
+
+// a table that ran empty, it is out of the tree but its slot stays taken until no core can walk it anymore
+// the parent keeps counting it as present meanwhile, so the parent cannot be detached under it
+struct EmptyTable {
+    VirtualAddress address;// first address covered by the table
+    PhysicalAddress table; // the table and its summary page, 0 if there is none
+    uint8_t level;         // level of the parent that holds the taken slot
+};
+
+// one empty level 1 table stays in the tree, so allocating and freeing across a table boundary does not free a table every time
+static VirtualAddress cached_table;// first address of the table, 0 if there is none
+
+// takes the table below the slot of address in the table at level out of the tree
+static EmptyTable detach(const Path& path, VirtualAddress address, uint8_t level) {
+    auto& entry = *path.entries[level - 1];
+    EmptyTable empty{address, entry.address(), level};
+    entry.raw = 0;
+    table_count--;
+    mark_full_up(path, address, level);
+    return empty;
+}
+
+// the lock is taken with interrupts disabled, interrupt handlers take slab pages too
+// tlb shootdowns wait for the other cores, so they only happen after it is dropped
+struct locked {
+    uint64_t flags;
+
+    locked() : flags(getFlags()) {
+        cli();
+        lock.lock();
+    }
+    ~locked() {
+        lock.unlock();
+        setFlags(flags);
+    }
+    locked(const locked&) = delete;
+    locked& operator=(const locked&) = delete;
+};
+
+// the slot of a freed page is only handed out again after every core dropped the old translation
+static void free_range(VirtualAddress address) {
+    PhysicalAddress page;
+    {
+        locked guard;
+        auto& e1 = *walk(address).entries[0];
+        if (!e1.present) {
+            panic("page_allocator::free of a page that is not allocated");
+        }
+        page = e1.address();
+        e1.raw = 0;
+    }
+    PageTable::invalidate(PageTable::kernel_address_space(), address, page_size);
+    PhysicalAllocator::free(page, 1);
+    EmptyTable empty{};
+    {
+        locked guard;
+        auto path = walk(address);
+        mark_not_full_up(path, address, 1);
+        if (--path.summaries[0]->present == 0) {
+            VirtualAddress table = address.address & ~(2_Mi - 1);
+            // the cached table may have been filled again since, then it just stops being the cached one
+            if (cached_table.address != 0 && cached_table.address != table.address) {
+                auto cached = walk(cached_table);
+                if (cached.summaries[0]->present == 0) empty = detach(cached, cached_table, 2);
             }
+            cached_table = table;
         }
-        if (empty) {
-            memset(&entry, 0, sizeof(PageTable::PageTableEntry));// clear entry
-            PhysicalAllocator::free(entry.address(), 1);
-        } else if (full) {
-            entry.metaData |= page_full_bit;
+    }
+    // level 3 tables of the kernel half are shared by all address spaces and stay
+    while (empty.table.address != 0) {
+        PageTable::invalidate_kernel_tables(empty.address);
+        PhysicalAllocator::free(empty.table, 2);
+        locked guard;
+        // the parent still counts the freed table, so it is in the tree and the walk is valid
+        auto path = walk(empty.address, empty.level);
+        if (empty.level == 2 && --path.summaries[1]->present == 0) {
+            empty = detach(path, empty.address, 3);
         } else {
-            entry.metaData &= ~page_full_bit;
+            mark_not_full_up(path, empty.address, empty.level);
+            empty.table = PhysicalAddress(0);
         }
     }
 }
 
 static void* malloc(size_t size) {
     if (size > page_size) return nullptr;
-    auto topLevelPage = PhysicalAddress{getCR3()}.mapTmp().as<PageTable::PageTable*>();
-    auto res = malloc_traverse(topLevelPage, 4, VirtualAddress{});
+    locked guard;
+    auto res = malloc_range(heap_start, 96_Ti + 10_Ti);
+    if (res) __atomic_add_fetch(&page_count, 1, __ATOMIC_RELAXED);
     return res;
 }
 
 static void free(void* ptr) {
     if (ptr == nullptr) return;
-    auto topLevelPage = PhysicalAddress{getCR3()}.mapTmp().as<PageTable::PageTable*>();
-    free_traverse(topLevelPage, 4, VirtualAddress{ptr});
+    free_range(VirtualAddress{ptr});
+    __atomic_sub_fetch(&page_count, 1, __ATOMIC_RELAXED);
 }
 
 static size_t size(void* ptr) {
@@ -266,283 +610,560 @@ static size_t size(void* ptr) {
     return page_size;
 }
 
+static void add_stats(kheap::Stats& stats) {
+    locked guard;
+    stats.pages = page_count;
+    stats.page_tables = table_count;
+}
+
 }// namespace page_allocator
 
 
 namespace small_allocator {
 
 void* allocate_page() {
-    auto topLevelPage = PhysicalAddress{getCR3()}.mapTmp().as<PageTable::PageTable*>();
-    auto res = page_allocator::malloc_traverse(topLevelPage, 4, VirtualAddress{}, 96_Ti + 10_Ti, 96_Ti + 20_Ti);
+    void* res;
+    {
+        page_allocator::locked guard;
+        res = page_allocator::malloc_range(96_Ti + 10_Ti, page_allocator::heap_end);
+    }
+    if (!res) return nullptr;
     memset(res, 0, page_size);
     return res;
 }
 
 void free_page(void* page) {
     if (page == nullptr) return;
-    auto topLevelPage = PhysicalAddress{getCR3()}.mapTmp().as<PageTable::PageTable*>();
-    page_allocator::free_traverse(topLevelPage, 4, VirtualAddress{page});
+    page_allocator::free_range(VirtualAddress{page});
 }
 
-namespace List {
-struct Node {
-    using type = void*;
-    static constexpr size_t element_count = (page_size - sizeof(Node*)) / sizeof(type);
-    Node* next;
-    type elements[element_count];
+// every slab is one page, the objects start at the beginning of the page and the header fills its last bytes
+// a slab belongs to the cpu that allocates from it, other cpus only return objects through the remote list
+struct Slab {
+    Slab* prev;        // partial slabs of the same class on the owning cpu
+    Slab* next;
+    Slab* pending_next;// slabs of the owning cpu with remote frees
+    uint32_t remote;   // offset of the last object freed by another cpu, with remote_pending once the owner was told
+    uint16_t free_head;// offset of the first freed object, freed objects link to the next one in their first two bytes
+    uint16_t free_count;
+    uint16_t bump;// offset of the first object that was never handed out
+    uint8_t size_class;
+    uint8_t owner;// index of the owning cpu cache
+    bool partial;
 };
 
-static_assert(sizeof(Node) == page_size, "invalid node size");
+static constexpr uint16_t end_of_list = 0xFFFF;
+static constexpr uint32_t remote_pending = 1 << 16;
+static constexpr size_t class_count = 10;
+static constexpr uint16_t class_sizes[class_count] = {4, 8, 16, 32, 64, 128, 256, 512, 1024, 2024};
+static constexpr size_t max_size = class_sizes[class_count - 1];
+static_assert(class_count == kheap::small_class_count);
+static_assert(2 * max_size + sizeof(Slab) <= page_size, "two objects of the largest class have to fit into a slab");
 
-bool is_empty(Node* list) {
-    return list == nullptr;
+static constexpr uint16_t objects_per_slab(uint8_t size_class) {
+    return (page_size - sizeof(Slab)) / class_sizes[size_class];
 }
-void push(Node** list, void* data) {
-    if (list == nullptr) {
-        panic("invalid usage of list in small_allocator::List::push");
-    }
-    while (*list != nullptr) {
-        for (auto& element : (*list)->elements) {
-            if (element == nullptr) {
-                element = data;
-                return;
-            }
+
+// size class for every size in steps of 4 bytes
+struct SizeClassTable {
+    uint8_t class_of[max_size / 4 + 1];
+
+    constexpr SizeClassTable() : class_of{} {
+        uint8_t size_class = 0;
+        for (size_t i = 0; i <= max_size / 4; ++i) {
+            while (class_sizes[size_class] < i * 4) ++size_class;
+            class_of[i] = size_class;
         }
-        list = &(*list)->next;
     }
-    (*list) = reinterpret_cast<Node*>(allocate_page());
-    (*list)->next = nullptr;
-    (*list)->elements[0] = data;
+};
+static constexpr SizeClassTable size_class_table;
+static_assert(size_class_table.class_of[(12 + 3) / 4] == 2, "12 bytes have to use the 16 byte class");
+static_assert(size_class_table.class_of[(max_size + 3) / 4] == class_count - 1);
+
+// apic ids are 8 bit, so this covers every core initLocalAPIC can bring up
+static constexpr size_t max_cpu_count = 256;
+// empty slabs kept per class in the depot before their pages go back to the page allocator
+static constexpr size_t depot_limit = 8;
+
+// statistics of one class on one cpu, only the sums over all cpus are meaningful
+struct ClassCounters {
+    uint64_t allocs;
+    uint64_t frees;    // local frees and collected remote frees
+    uint64_t requested;// bytes asked for by all allocations
+    uint64_t pages;    // pages taken minus pages given back
+};
+
+// only touched by its own cpu with interrupts disabled, except pending which other cpus push to
+struct CpuCache {
+    Slab* partial[class_count];// slabs with at least one free object
+    Slab* pending[class_count];// slabs with objects freed by other cpus, the owner collects them when partial runs empty
+    ClassCounters counters[class_count];
+};
+static CpuCache caches[max_cpu_count];
+
+// empty slabs shared by all cpus, a cpu hands slabs it does not need over and takes them before asking for new pages
+struct Depot {
+    ticket_lock lock{"slab depot"};
+    Slab* slabs[class_count]{};// linked through next
+    size_t count[class_count]{};
+} depot;
+
+// before the cores are known only the boot processor runs, acpi lists it first
+static uint8_t current_cpu() {
+    return APIC::get_cpu_number();
 }
-void* peek(Node* list) {
-    while (list != nullptr) {
-        for (const auto& element : list->elements) {
-            if (element != nullptr) {
-                return element;
-            }
-        }
-        list = list->next;
-    }
-    return nullptr;
+
+static Slab* slab_of(void* ptr) {
+    return reinterpret_cast<Slab*>((reinterpret_cast<size_t>(ptr) & ~(page_size - 1)) + page_size - sizeof(Slab));
+}
+
+static uint8_t* page_of(Slab* slab) {
+    return reinterpret_cast<uint8_t*>(reinterpret_cast<size_t>(slab) & ~(page_size - 1));
 }
-void remove(Node** list, void* data) {
-    if (list == nullptr) {
-        panic("invalid usage of list in small_allocator::List::remove");
+
+static void push_partial(CpuCache& cache, Slab* slab) {
+    auto& head = cache.partial[slab->size_class];
+    slab->prev = nullptr;
+    slab->next = head;
+    if (head) head->prev = slab;
+    head = slab;
+    slab->partial = true;
+}
+
+static void remove_partial(CpuCache& cache, Slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cache.partial[slab->size_class] = slab->next;
     }
-    while (*list != nullptr) {
-        bool empty = true;
-        for (auto& element : (*list)->elements) {
-            if (element == data) {
-                element = nullptr;
-            }
-            if (element != nullptr) {
-                empty = false;
-            }
-        }
-        if (empty) {
-            auto next = (*list)->next;
-            free_page(*list);
-            *list = next;
-        } else {
-            list = &(*list)->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->partial = false;
+}
+
+static void init_slab(Slab* slab, uint8_t size_class) {
+    slab->free_head = end_of_list;
+    slab->free_count = objects_per_slab(size_class);
+    slab->bump = 0;
+    slab->remote = end_of_list;
+    slab->size_class = size_class;
+}
+
+// moves the objects other cpus freed into the local free lists of their slabs
+static void collect_remote(CpuCache& cache, uint8_t size_class) {
+    auto* slab = __atomic_exchange_n(&cache.pending[size_class], nullptr, __ATOMIC_ACQUIRE);
+    while (slab) {
+        // once the pending bit is cleared another cpu may push the slab again
+        auto* next = slab->pending_next;
+        uint32_t remote = __atomic_exchange_n(&slab->remote, end_of_list, __ATOMIC_ACQ_REL);
+        uint8_t* page = page_of(slab);
+        uint16_t head = remote & 0xFFFF;
+        uint16_t tail = head;
+        uint16_t count = 1;
+        while (*reinterpret_cast<uint16_t*>(page + tail) != end_of_list) {
+            tail = *reinterpret_cast<uint16_t*>(page + tail);
+            count++;
         }
+        *reinterpret_cast<uint16_t*>(page + tail) = slab->free_head;
+        slab->free_head = head;
+        slab->free_count += count;
+        cache.counters[size_class].frees += count;
+        if (!slab->partial) push_partial(cache, slab);
+        slab = next;
+    }
+}
+
+// a slab for the class from the remote frees or the depot, nullptr if a new page is needed
+static Slab* take_slab(CpuCache& cache, uint8_t size_class, uint8_t cpu) {
+    collect_remote(cache, size_class);
+    if (cache.partial[size_class]) return cache.partial[size_class];
+    Slab* slab;
+    {
+        lock_guard guard(depot.lock);
+        slab = depot.slabs[size_class];
+        if (!slab) return nullptr;
+        depot.slabs[size_class] = slab->next;
+        depot.count[size_class]--;
     }
+    slab->owner = cpu;
+    push_partial(cache, slab);
+    return slab;
 }
-}// namespace List
 
-struct Data {
-    List::Node* freeList[10];// 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048
-} data;
+// hands an empty slab to the depot, returns its page if the depot is full
+static void* give_slab(Slab* slab) {
+    lock_guard guard(depot.lock);
+    if (depot.count[slab->size_class] == depot_limit) return page_of(slab);
+    slab->next = depot.slabs[slab->size_class];
+    depot.slabs[slab->size_class] = slab;
+    depot.count[slab->size_class]++;
+    return nullptr;
+}
+
+static void free_remote(Slab* slab, void* ptr) {
+    uint8_t* page = page_of(slab);
+    uint16_t offset = static_cast<uint8_t*>(ptr) - page;
+    uint32_t old = __atomic_load_n(&slab->remote, __ATOMIC_RELAXED);
+    do {
+        *static_cast<uint16_t*>(ptr) = old & 0xFFFF;
+    } while (!__atomic_compare_exchange_n(&slab->remote, &old, offset | remote_pending, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    if (old & remote_pending) return;
+    // first remote free since the owner last collected, the owner may not have the slab in its partial list
+    auto& head = caches[slab->owner].pending[slab->size_class];
+    auto* next = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    do {
+        slab->pending_next = next;
+    } while (!__atomic_compare_exchange_n(&head, &next, slab, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
 static void init() {
-    memset(&data, 0, sizeof(data));
-}
-static size_t get_pref_size(size_t size) {
-    if (size <= 4) return 4;
-    if (size <= 8) return 8;
-    if (size <= 16) return 16;
-    if (size <= 32) return 32;
-    if (size <= 64) return 64;
-    if (size <= 128) return 128;
-    if (size <= 256) return 256;
-    if (size <= 512) return 512;
-    if (size <= 1024) return 1024;
-    if (size <= 2047) return 2047;
-    return 0;
-}
-static size_t get_pref_size_from_bucket(uint8_t bucket) {
-    if (bucket == 0) return 4;
-    if (bucket == 1) return 8;
-    if (bucket == 2) return 16;
-    if (bucket == 3) return 32;
-    if (bucket == 4) return 64;
-    if (bucket == 5) return 128;
-    if (bucket == 6) return 256;
-    if (bucket == 7) return 512;
-    if (bucket == 8) return 1024;
-    if (bucket == 9) return 2047;
-    panic("invalid bucket in small_allocator::get_pref_size_from_bucket");
-}
-static uint8_t get_bucket(size_t prefSize) {
-    if (prefSize == 4) return 0;
-    if (prefSize == 8) return 1;
-    if (prefSize == 16) return 2;
-    if (prefSize == 32) return 3;
-    if (prefSize == 64) return 4;
-    if (prefSize == 128) return 5;
-    if (prefSize == 256) return 6;
-    if (prefSize == 512) return 7;
-    if (prefSize == 1024) return 8;
-    if (prefSize == 2047) return 9;
-    panic("invalid prefSize in small_allocator::get_bucket");
-}
-static size_t get_bitmap_element_count(size_t bucket) {
-    if (bucket == 0) return 992;
-    if (bucket == 1) return 504;
-    if (bucket == 2) return 253;
-    if (bucket == 3) return 127;
-    if (bucket == 4) return 63;
-    if (bucket == 5) return 31;
-    if (bucket == 6) return 15;
-    if (bucket == 7) return 7;
-    if (bucket == 8) return 3;
-    if (bucket == 9) return 2;
-    panic("invalid bucket in small_allocator::bitmap_element_count");
+    memset(caches, 0, sizeof(caches));
+    // the depot is constant initialized, clearing it would also erase the name of its lock
 }
 static void* malloc(size_t size) {
-    auto prefSize = get_pref_size(size);
-    if (prefSize == 0) return nullptr;
-    auto bucket = get_bucket(prefSize);
-
-    if (List::is_empty(data.freeList[bucket])) {
+    if (size > max_size) return nullptr;
+    uint8_t size_class = size_class_table.class_of[(size + 3) / 4];
+    // the cache is per cpu, only interrupts on this core can interfere
+    auto flags = getFlags();
+    cli();
+    uint8_t cpu = current_cpu();
+    auto& cache = caches[cpu];
+    auto* slab = cache.partial[size_class];
+    if (!slab) slab = take_slab(cache, size_class, cpu);
+    if (!slab) {
+        // the page heap disables interrupts only while it holds its lock, its shootdowns have to reach this core
+        setFlags(flags);
         auto* page = allocate_page();
-        memset(page, 0, page_size);
-        *(reinterpret_cast<uint8_t*>(page) + page_size - sizeof(uint8_t)) = bucket;// bucket number at end of page
-        List::push(&data.freeList[bucket], page);
-    }
-
-    auto* page = reinterpret_cast<uint8_t*>(List::peek(data.freeList[bucket]));
-    size_t bitmap_element_count = get_bitmap_element_count(bucket);
-    size_t bitmap_size = (bitmap_element_count + 7) / 8;
-    auto* bitmap = page + page_size - sizeof(uint8_t) - bitmap_size;
-    size_t result = ~0;
-    size_t count = 0;
-    for (size_t i = 0; i < bitmap_element_count; ++i) {
-        if (!(bitmap[i / 8] & (1 << (i % 8)))) {
-            if (result == ~0) {
-                result = i;
-                bitmap[i / 8] |= (1 << (i % 8));
-            }
-            ++count;
-        }
+        if (!page) return nullptr;
+        cli();
+        slab = slab_of(page);
+        init_slab(slab, size_class);
+        slab->owner = cpu;
+        push_partial(cache, slab);
+        cache.counters[size_class].pages++;
     }
-    if (result == ~0) {
-        panic("invalid bitmap in small_allocator::malloc");
+    uint8_t* page = page_of(slab);
+    uint8_t* object;
+    if (slab->free_head != end_of_list) {
+        object = page + slab->free_head;
+        slab->free_head = *reinterpret_cast<uint16_t*>(object);
+    } else {
+        object = page + slab->bump;
+        slab->bump += class_sizes[size_class];
     }
-    if (count == 1) {
-        List::remove(&data.freeList[bucket], page);
+    if (--slab->free_count == 0) {
+        remove_partial(cache, slab);
     }
-    return page + result * prefSize;
+    cache.counters[size_class].allocs++;
+    cache.counters[size_class].requested += size;
+    setFlags(flags);
+    return object;
 }
 static void free(void* ptr) {
     if (ptr == nullptr) return;
-    auto* page = reinterpret_cast<uint8_t*>(reinterpret_cast<size_t>(ptr) & ~(page_size - 1));
-    auto offset = reinterpret_cast<size_t>(ptr) - reinterpret_cast<size_t>(page);
-    uint8_t bucket = *(uint8_t*) (page + page_size - sizeof(uint8_t));
-    auto prefSize = get_pref_size_from_bucket(bucket);
-    size_t bitmap_element_count = get_bitmap_element_count(bucket);
-    size_t bitmap_size = (bitmap_element_count + 7) / 8;
-    auto* bitmap = page + page_size - sizeof(uint8_t) - bitmap_size;
-    auto index = offset / prefSize;
-    bool page_full = true;
-    bool page_empty = true;
-    for (size_t i = 0; i < bitmap_element_count; ++i) {
-        if (!(bitmap[i / 8] & (1 << (i % 8)))) {
-            page_full = false;
-        }
-        if (bitmap[i / 8] & (1 << (i % 8))) {
-            page_empty = false;
-        }
+    auto* slab = slab_of(ptr);
+    auto flags = getFlags();
+    cli();
+    uint8_t cpu = current_cpu();
+    if (slab->owner != cpu) {
+        free_remote(slab, ptr);
+        setFlags(flags);
+        return;
     }
-    bitmap[index / 8] &= ~(1 << (index % 8));
-    if (page_empty) {
-        free_page(page);
-    } else if (page_full) {
-        List::push(&data.freeList[bucket], page);
+    auto& cache = caches[cpu];
+    uint8_t* page = page_of(slab);
+    *reinterpret_cast<uint16_t*>(ptr) = slab->free_head;
+    slab->free_head = static_cast<uint8_t*>(ptr) - page;
+    slab->free_count++;
+    cache.counters[slab->size_class].frees++;
+    void* release = nullptr;
+    if (!slab->partial) {
+        push_partial(cache, slab);
+    } else if (slab->free_count == objects_per_slab(slab->size_class) && (slab->prev || slab->next)) {
+        // keep the last partial slab of a class, so alternating malloc and free does not allocate pages
+        // no object of an empty slab is left, so no other cpu can free into it anymore
+        remove_partial(cache, slab);
+        release = give_slab(slab);
+        if (release) cache.counters[slab->size_class].pages--;
     }
+    setFlags(flags);
+    free_page(release);
 }
 static size_t size(void* ptr) {
     if (ptr == nullptr) return 0;
-    auto* page = reinterpret_cast<uint8_t*>(reinterpret_cast<size_t>(ptr) & ~(page_size - 1));
-    auto bucket = *(page + page_size - sizeof(uint8_t));
-    auto prefSize = get_pref_size_from_bucket(bucket);
-    return prefSize;
+    return class_sizes[slab_of(ptr)->size_class];
 }
 
-}// namespace small_allocator
+// frees an object as if another cpu did it, the owner has to find it again
+static const char* test_remote_free() {
+    auto* ptr1 = malloc(48);
+    auto* ptr2 = malloc(48);
+    if (ptr1 == nullptr || ptr2 == nullptr) return "small allocator failed to allocate memory";
+    auto* slab = slab_of(ptr1);
+    auto& cache = caches[slab->owner];
+    uint16_t free_count = slab->free_count;
+    auto flags = getFlags();
+    cli();
+    free_remote(slab, ptr1);
+    bool pending = cache.pending[slab->size_class] == slab && (slab->remote & remote_pending);
+    bool counted = slab->free_count == free_count;
+    collect_remote(cache, slab->size_class);
+    bool collected = slab->remote == end_of_list && slab->free_count == free_count + 1;
+    setFlags(flags);
+    if (!pending) return "remote free did not reach the owner";
+    if (!counted) return "remote free changed the local free list";
+    if (!collected) return "owner did not collect the remote free";
+    auto* ptr3 = malloc(48);
+    free(ptr3);
+    free(ptr2);
+    if (ptr3 != ptr1) return "remote freed object was not reused";
+    return nullptr;
+}
+
+static void add_stats(kheap::Stats& stats) {
+    for (size_t i = 0; i < class_count; ++i) {
+        auto& total = stats.classes[i];
+        uint64_t requested = 0;
+        total.size = class_sizes[i];
+        for (auto& cache : caches) {
+            total.allocs += cache.counters[i].allocs;
+            total.frees += cache.counters[i].frees;
+            total.pages += cache.counters[i].pages;
+            requested += cache.counters[i].requested;
+        }
+        total.live = total.allocs - total.frees;
+        total.wasted = total.allocs * total.size - requested;
+    }
+}
 
+}// namespace small_allocator
 namespace large_allocator {
 
-static btree_map<VirtualAddress, size_t>* ptr_size;// size in pages
-static spinlock* lock;
+static constexpr VirtualAddress region_start = 96_Ti + 20_Ti;
+static constexpr VirtualAddress region_end = 96_Ti + 30_Ti;
+
+// free extents ordered by size and then by address, for best fit
+struct extent {
+    size_t size;
+    VirtualAddress start;
+
+    bool operator==(const extent& other) const { return size == other.size && start == other.start; }
+    bool operator!=(const extent& other) const { return !(*this == other); }
+    bool operator<(const extent& other) const { return size < other.size || (size == other.size && start < other.start); }
+    bool operator>(const extent& other) const { return other < *this; }
+    bool operator<=(const extent& other) const { return !(other < *this); }
+    bool operator>=(const extent& other) const { return !(*this < other); }
+};
+
+static btree_map<VirtualAddress, size_t>* ptr_size;// size in bytes
+static btree<extent>* free_by_size;
+static btree_map<VirtualAddress, size_t>* free_by_start;// size of the free extent starting at the key
+static btree_map<VirtualAddress, size_t>* free_by_end;  // size of the free extent ending at the key
+static spinlock lock{"large heap"};
+// statistics, guarded by lock
+static uint64_t region_count;
+static uint64_t region_bytes;
+static uint64_t extent_count;
+static uint64_t alloc_count;
+static uint64_t free_count;
+
+static void insert_free(VirtualAddress start, size_t size) {
+    extent_count++;
+    free_by_size->insert(extent{size, start});
+    free_by_start->insert(start, size);
+    free_by_end->insert(start + size, size);
+}
+
+static void remove_free(VirtualAddress start, size_t size) {
+    extent_count--;
+    free_by_size->remove(extent{size, start});
+    free_by_start->remove(start);
+    free_by_end->remove(start + size);
+}
+
+static VirtualAddress align(VirtualAddress address, uint64_t alignment) {
+    return VirtualAddress((address.address + alignment - 1) & ~(alignment - 1));
+}
+
+// the smallest free extent that fits size bytes at the alignment
+static optional<extent> best_fit(size_t size, uint64_t alignment) {
+    auto fit = free_by_size->lower_bound(extent{size, VirtualAddress(0)});
+    if (fit && align(fit->start, alignment).address + size <= fit->start.address + fit->size) {
+        return fit;
+    }
+    // every extent this large fits, whatever its alignment
+    return free_by_size->lower_bound(extent{size + alignment - page_size, VirtualAddress(0)});
+}
+
+// maps size bytes at start with physical blocks that are as large as possible, so map_range can use huge pages
+static bool back(VirtualAddress start, size_t size, PageTable::Flags flags) {
+    size_t pages = size / page_size;
+    size_t chunk = 1;
+    while (chunk * 2 <= pages) chunk *= 2;
+    size_t done = 0;
+    while (done < pages) {
+        while (chunk > pages - done) chunk /= 2;
+        auto block = PhysicalAllocator::alloc(chunk);
+        if (!block) {
+            if (chunk == 1) return false;
+            chunk /= 2;
+            continue;
+        }
+        PageTable::map_range(*block, start + done * page_size, chunk * page_size, flags);
+        done += chunk;
+    }
+    return true;
+}
+
+// unmaps size bytes at start and frees the physical memory behind them in contiguous runs
+// called without the lock: the unmap shoots down the other cores, which may spin on the lock with interrupts off
+// the range is neither allocated nor free while it runs, so no other core touches it
+static void release(VirtualAddress start, size_t size) {
+    size_t offset = 0;
+    while (offset < size) {
+        auto first = PageTable::get(start + offset).value_or_panic("invalid page in large_allocator::free");
+        size_t run = page_size;
+        while (offset + run < size) {
+            auto next = PageTable::get(start + offset + run);
+            if (!next || next->address != first.address + run) break;
+            run += page_size;
+        }
+        PageTable::unmap_range(start + offset, run);
+        PhysicalAllocator::free(first, run / page_size);
+        offset += run;
+    }
+}
+
+// returns size bytes at start to the free extents, merged with the free neighbours
+static void insert_coalesced(VirtualAddress start, size_t size) {
+    if (auto before = free_by_end->find(start)) {
+        remove_free(start - *before, *before);
+        start = start - *before;
+        size += *before;
+    }
+    if (auto after = free_by_start->find(start + size)) {
+        remove_free(start + size, *after);
+        size += *after;
+    }
+    insert_free(start, size);
+}
 
 static void init() {
     ptr_size = new btree_map<VirtualAddress, size_t>();
-    lock = new spinlock();
+    free_by_size = new btree<extent>();
+    free_by_start = new btree_map<VirtualAddress, size_t>();
+    free_by_end = new btree_map<VirtualAddress, size_t>();
+    insert_free(region_start, region_end.address - region_start.address);
 }
 static void* malloc(size_t size) {
-    lock_guard<spinlock> guard(*lock);
+    lock_guard<spinlock> guard(lock);
     size_t pages = (size + page_size - 1) / page_size;
-    VirtualAddress last_region_end = 96_Ti + 20_Ti;
-    ptr_size->iterate_kv([&pages, &last_region_end](const VirtualAddress& key, const size_t& value) -> bool {
-        if (key.address - last_region_end.address > pages * page_size) {
-            return false;
-        }
-        last_region_end = key.address + value * page_size;
-        return true;
-    });
-    if (last_region_end.address + pages * page_size > 96_Ti + 30_Ti) {
+    size = pages * page_size;
+    // regions of at least 2MiB start 2MiB aligned, so they can be backed by huge pages
+    uint64_t alignment = size >= 2_Mi ? 2_Mi : page_size;
+    auto fit = best_fit(size, alignment);
+    if (!fit) {
         panic("out of memory in large_allocator::malloc");
     }
-    auto start_address = last_region_end;
-    for (size_t i = 0; i < pages; ++i) {
-        auto page = PhysicalAllocator::alloc(1).value_or_panic("out of physical memory in large_allocator::malloc");
-        PageTable::map(page, start_address + i * page_size, {.writeable = true, .user = false, .writeThrough = false, .cacheDisabled = false});
+    auto start_address = align(fit->start, alignment);
+    remove_free(fit->start, fit->size);
+    if (start_address != fit->start) {
+        insert_free(fit->start, start_address.address - fit->start.address);
     }
-    ptr_size->insert(start_address, pages * page_size);
+    auto end_address = start_address + size;
+    if (end_address.address < fit->start.address + fit->size) {
+        insert_free(end_address, fit->start.address + fit->size - end_address.address);
+    }
+    PageTable::Flags flags{.writeable = true, .user = false, .writeThrough = false, .cacheDisabled = false, .global = true};
+    if (!back(start_address, size, flags)) {
+        panic("out of physical memory in large_allocator::malloc");
+    }
+    ptr_size->insert(start_address, size);
+    region_count++;
+    region_bytes += size;
+    alloc_count++;
     return start_address.as<void*>();
 }
 static void free(void* ptr) {
     if (ptr == nullptr) return;
-    lock_guard<spinlock> guard(*lock);
-
-    auto size = ptr_size->find(VirtualAddress(ptr))
-                        .value_or_panic("removed non existing ptr in large_allocator::free");
-    for (size_t i = 0; i < size; i += page_size) {
-        auto page = PageTable::get(VirtualAddress(ptr) + i).value_or_panic("invalid page in large_allocator::free");
-        PhysicalAllocator::free(page, 1);
-        PageTable::unmap(VirtualAddress(ptr) + i);
-    }
-
-    if (!ptr_size->remove(VirtualAddress(ptr))) {
-        panic("removed non existing ptr in large_allocator::free");
+    auto start = VirtualAddress(ptr);
+    size_t size;
+    {
+        lock_guard<spinlock> guard(lock);
+        size = ptr_size->find(start)
+                       .value_or_panic("removed non existing ptr in large_allocator::free");
+        ptr_size->remove(start);
+        region_count--;
+        region_bytes -= size;
+        free_count++;
     }
+    release(start, size);
+    lock_guard<spinlock> guard(lock);
+    insert_coalesced(start, size);
 }
 static size_t size(void* ptr) {
     if (ptr == nullptr) return 0;
-    lock_guard<spinlock> guard(*lock);
+    lock_guard<spinlock> guard(lock);
     auto res = ptr_size->find(VirtualAddress(ptr));
     return res.value_or(0);
 }
+// grows the region into the free extent behind it or gives its tail back, false if it has to move
+static bool resize(void* ptr, size_t size) {
+    auto start = VirtualAddress(ptr);
+    size = (size + page_size - 1) / page_size * page_size;
+    size_t old_size;
+    {
+        lock_guard<spinlock> guard(lock);
+        old_size = ptr_size->find(start)
+                           .value_or_panic("resized non existing ptr in large_allocator::resize");
+        if (size == old_size) return true;
+        if (size < old_size) {
+            ptr_size->remove(start);
+            ptr_size->insert(start, size);
+            region_bytes -= old_size - size;
+        }
+    }
+    if (size < old_size) {
+        release(start + size, old_size - size);
+        lock_guard<spinlock> guard(lock);
+        insert_coalesced(start + size, old_size - size);
+        return true;
+    }
+    // growing only maps new pages, so no shootdown runs under the lock
+    lock_guard<spinlock> guard(lock);
+    auto end = start + old_size;
+    auto after = free_by_start->find(end);
+    if (!after || *after < size - old_size) return false;
+    remove_free(end, *after);
+    if (*after > size - old_size) {
+        insert_free(start + size, *after - (size - old_size));
+    }
+    PageTable::Flags flags{.writeable = true, .user = false, .writeThrough = false, .cacheDisabled = false, .global = true};
+    if (!back(end, size - old_size, flags)) {
+        panic("out of physical memory in large_allocator::resize");
+    }
+    ptr_size->remove(start);
+    ptr_size->insert(start, size);
+    region_bytes += size - old_size;
+    return true;
+}
+
+static void add_stats(kheap::Stats& stats) {
+    lock_guard<spinlock> guard(lock);
+    stats.large_regions = region_count;
+    stats.large_bytes = region_bytes;
+    stats.large_free_extents = extent_count;
+    stats.large_allocs = alloc_count;
+    stats.large_frees = free_count;
+}
 
 }// namespace large_allocator
 
 
 void* operator new(size_t size) {
-    return memset(kmalloc(size), 0, size);
+    return memset(kheap::allocate(size, __builtin_return_address(0)), 0, size);
 }
 void* operator new[](size_t size) {
-    return memset(kmalloc(size), 0, size);
+    return memset(kheap::allocate(size, __builtin_return_address(0)), 0, size);
 }
 void operator delete(void* ptr) noexcept {
     kfree(ptr);
@@ -0,0 +1,62 @@
+#include "memory/kmem_cache.h"
+#include "data/linked_list.h"
+#include "out/log.h"
+
+namespace kmem {
+
+struct counted {
+    static inline uint64_t constructions = 0;
+    uint64_t value;
+    counted() : value(42) { constructions++; }
+};
+
+static kmem_cache<uint64_t> plain_cache;
+static kmem_cache<counted, true> constructed_cache;
+
+template<typename allocator>
+static uint64_t list_cycles() {
+    constexpr size_t count = 1024;
+    linked_list<uint64_t, allocator> list;
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < count; ++i) {
+        list.push_back(i);
+    }
+    while (list.size > 0) {
+        list.pop_back();
+    }
+    return (rdtsc() - start) / count;
+}
+
+Test::Result test() {
+    {
+        auto* ptr1 = plain_cache.create(7ul);
+        if (ptr1 == nullptr) return Test::Result::failure("cache failed to allocate an object");
+        if (*ptr1 != 7) return Test::Result::failure("cache did not construct the object");
+        plain_cache.destroy(ptr1);
+        auto* ptr2 = plain_cache.create();
+        if (ptr2 != ptr1) return Test::Result::failure("allocation after destroy didn't return the same object");
+        auto stats = plain_cache.get_stats();
+        if (stats.allocated != 1 || stats.slabs != 1) return Test::Result::failure("wrong cache statistics");
+        plain_cache.destroy(ptr2);
+    }
+    {
+        auto* ptr1 = constructed_cache.create();
+        if (ptr1 == nullptr) return Test::Result::failure("cache failed to allocate an object");
+        if (ptr1->value != 42) return Test::Result::failure("cache did not construct the object");
+        uint64_t constructions = counted::constructions;
+        constructed_cache.destroy(ptr1);
+        auto* ptr2 = constructed_cache.create();
+        constructed_cache.destroy(ptr2);
+        if (counted::constructions != constructions) return Test::Result::failure("construct_once object was constructed again");
+        auto stats = constructed_cache.get_stats();
+        if (constructions != stats.allocated + stats.cached) return Test::Result::failure("construct_once objects were not constructed with their slab");
+    }
+    // the first run fills the caches, the second one measures
+    list_cycles<single_deleter>();
+    list_cycles<cache_allocator>();
+    Log::printf(Log::Info, "kmem", "linked_list push and pop: %i cycles with the kernel heap, %i cycles with the node cache\n",
+                list_cycles<single_deleter>(), list_cycles<cache_allocator>());
+    return Test::Result::success();
+}
+
+}// namespace kmem
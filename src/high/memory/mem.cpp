@@ -1,26 +1,91 @@
 #include "memory/mem.h"
+#include "ACPI/APIC.h"
+#include "asm/util.h"
 #include "features/bytes.h"
+#include "features/lock.h"
 #include "features/optional.h"
 #include "multiboot2/multiboot2.h"
+#include "out/log.h"
 #include "out/panic.h"
+#include "test/test.h"
 #include "util/interval.h"
 
 
 namespace PhysicalAllocator {
 
-static uint8_t multiboot_memory_info[page_size];
-static uint64_t multiboot_memory_info_size = 0;
 static uint64_t total_memory;
 
-uint8_t* physical_memory_bitmap;
-uint64_t physical_memory_bitmap_size;
-uint64_t last_checked_memory_bitmap_index = 0;
+// usable memory from the multiboot memory map, sorted by base
+struct MemoryRegion {
+    uint64_t base;       // page aligned
+    uint64_t page_count;
+    uint64_t first_index;// bitmap index of the first page
+};
+static constexpr uint64_t max_memory_region_count = 128;
+static MemoryRegion memory_regions[max_memory_region_count];
+static uint64_t memory_region_count = 0;
+static interval<uint64_t> multiboot_info_region;
+
+uint8_t* physical_memory_bitmap;// 1 bit per usable page, set if the page is allocated
+uint64_t physical_memory_bitmap_size;// number of usable pages
+
+// binary buddy allocator, order 0 is one page, max_order is 1GiB
+static constexpr uint8_t max_order = 18;
+static_assert((page_size << max_order) == 1_Gi);
+
+// free blocks are linked through their first bytes, links are physical addresses (0 = end of list)
+struct FreeBlock {
+    uint64_t next;
+    uint64_t prev;
+};
+
+static uint64_t free_lists[max_order + 1];
+static uint8_t* free_block_bitmaps[max_order + 1];// bit (pfn >> order) is set if that block is in free_lists[order]
+static uint16_t* share_counts;// owners beyond the first, indexed like the allocation bitmap
+// share count of a page cached in a magazine, it stays marked in the bitmap, so this tells a second free apart
+static constexpr uint16_t cached_page = 0xFFFF;
+static uint64_t max_page_frame;
+static bool map_physical_high = false;
+
+// protects the buddy free lists and the allocation bitmap
+static spinlock allocator_lock{"physical allocator"};
+
+// the allocator lock is only taken with interrupts disabled, single pages are allocated and freed from interrupts too
+struct allocator_guard {
+    uint64_t flags;
+
+    allocator_guard() : flags(getFlags()) {
+        cli();
+        allocator_lock.lock();
+    }
+    ~allocator_guard() {
+        allocator_lock.unlock();
+        setFlags(flags);
+    }
+    allocator_guard(const allocator_guard&) = delete;
+    allocator_guard& operator=(const allocator_guard&) = delete;
+};
+
+// per cpu cache of single pages, refilled from and drained to the buddy allocator in batches
+static constexpr uint64_t max_cpu_count = 64;
+static constexpr uint64_t magazine_size = 64;
+static constexpr uint8_t magazine_batch_order = 5;
+static constexpr uint64_t magazine_batch = 1 << magazine_batch_order;
+static_assert(magazine_batch <= magazine_size);
+
+struct Magazine {
+    uint64_t count;
+    uint64_t pages[magazine_size];
+    MagazineStats stats;
+};
+static Magazine magazines[max_cpu_count];
 
 static optional<interval<uint64_t>> findSubregionWithSize(interval<uint64_t> region, uint64_t size) {
     interval<uint64_t> reserved[]{
             {saveReadSymbol("trampolineStart"), saveReadSymbol("trampolineEnd")},
             {saveReadSymbol("physical_start"), saveReadSymbol("physical_end")},
-            {0xA0000, 0x100000}};
+            {0xA0000, 0x100000},
+            multiboot_info_region};
 
     if (region.size() < size) {
         return {};
@@ -54,83 +119,233 @@ static optional<interval<uint64_t>> findSubregionWithSize(interval<uint64_t> reg
     return {};
 }
 
+// last region with base <= address, memory_region_count if there is none
+static uint64_t findRegion(uint64_t address) {
+    uint64_t low = 0;
+    uint64_t high = memory_region_count;
+    while (low < high) {
+        uint64_t mid = (low + high) / 2;
+        if (memory_regions[mid].base <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low == 0 ? memory_region_count : low - 1;
+}
+
 static optional<PhysicalAddress> memoryBitmapIndexToPhysical(uint64_t index) {
-    uint32_t entry_size = *(uint32_t*) (multiboot_memory_info + 0);
-    uint32_t entry_version = *(uint32_t*) (multiboot_memory_info + 4);
-    uint8_t* entries = multiboot_memory_info + 8;
-    uint32_t entry_count = (multiboot_memory_info_size - 4) / entry_size;
-    struct MemoryMapEntry {
-        uint64_t base_addr;
-        uint64_t length;
-        uint32_t type;
-        uint32_t reserved;
-    };
-    for (uint32_t i = 0; i < entry_count; ++i) {
-        auto* entry = (MemoryMapEntry*) (entries + i * entry_size);
-        if (entry->type == 1) {
-            if (index * page_size < entry->length) {
-                return {entry->base_addr + index * page_size};
-            } else {
-                index -= entry->length / page_size;
-            }
+    if (index >= physical_memory_bitmap_size) return {};
+    // last region with first_index <= index
+    uint64_t low = 0;
+    uint64_t high = memory_region_count;
+    while (low < high) {
+        uint64_t mid = (low + high) / 2;
+        if (memory_regions[mid].first_index <= index) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
-    return {};
+    auto& region = memory_regions[low - 1];
+    return PhysicalAddress{region.base + (index - region.first_index) * page_size};
 }
 
 static optional<uint64_t> physicalAddressPageToMemoryIndex(PhysicalAddress address) {
     uint64_t aligned = address.address & ~(page_size - 1);
+    auto region_index = findRegion(aligned);
+    if (region_index == memory_region_count) return {};
+    auto& region = memory_regions[region_index];
+    uint64_t page = (aligned - region.base) / page_size;
+    if (page >= region.page_count) return {};
+    return region.first_index + page;
+}
 
-    uint32_t entry_size = *(uint32_t*) (multiboot_memory_info + 0);
-    uint32_t entry_version = *(uint32_t*) (multiboot_memory_info + 4);
-    uint8_t* entries = multiboot_memory_info + 8;
-    uint32_t entry_count = (multiboot_memory_info_size - 4) / entry_size;
-    struct MemoryMapEntry {
-        uint64_t base_addr;
-        uint64_t length;
-        uint32_t type;
-        uint32_t reserved;
-    };
-    uint64_t current = 0;
-    for (uint32_t index = 0; index < entry_count; ++index) {
-        auto* entry = (MemoryMapEntry*) (entries + index * entry_size);
-        if (entry->type == 1) {
-            if (aligned >= entry->base_addr && aligned - entry->base_addr < entry->length) {
-                return current + (aligned - entry->base_addr) / page_size;
-            } else {
-                current += entry->length / page_size;
-            }
+static bool testBitmap(uint64_t index) {
+    return physical_memory_bitmap[index / 8] & (1 << (index % 8));
+}
+
+// sets count bits starting at index, whole bytes and words are written at once
+static void setBitmapRange(uint64_t index, uint64_t count, bool value) {
+    uint64_t end = index + count;
+    while (index < end && index % 8) {
+        if (value) {
+            physical_memory_bitmap[index / 8] |= 1 << (index % 8);
+        } else {
+            physical_memory_bitmap[index / 8] &= ~(1 << (index % 8));
         }
+        index++;
     }
-    return {};
+    while (index + 8 <= end && index % 64) {
+        physical_memory_bitmap[index / 8] = value ? 0xFF : 0;
+        index += 8;
+    }
+    while (index + 64 <= end) {
+        *reinterpret_cast<uint64_t*>(physical_memory_bitmap + index / 8) = value ? ~0ull : 0;
+        index += 64;
+    }
+    while (index + 8 <= end) {
+        physical_memory_bitmap[index / 8] = value ? 0xFF : 0;
+        index += 8;
+    }
+    while (index < end) {
+        if (value) {
+            physical_memory_bitmap[index / 8] |= 1 << (index % 8);
+        } else {
+            physical_memory_bitmap[index / 8] &= ~(1 << (index % 8));
+        }
+        index++;
+    }
+}
+
+// first index in [index, end) whose bit equals value, end if there is none
+static uint64_t findBitmap(uint64_t index, uint64_t end, bool value) {
+    while (index < end && index % 64) {
+        if (testBitmap(index) == value) return index;
+        index++;
+    }
+    while (index + 64 <= end) {
+        uint64_t word = *reinterpret_cast<uint64_t*>(physical_memory_bitmap + index / 8);
+        if (!value) word = ~word;
+        if (word) return index + __builtin_ctzll(word);
+        index += 64;
+    }
+    while (index < end) {
+        if (testBitmap(index) == value) return index;
+        index++;
+    }
+    return end;
 }
 
 static void reserveMemory(PhysicalAddress start, uint64_t size, bool reserve = true) {
     if (size == 0) return;
-    PhysicalAddress end = {(start.address + size + (page_size - 1)) & ~(page_size - 1)};
-    auto startIndexOpt = physicalAddressPageToMemoryIndex(start);
-    auto endIndexOpt = physicalAddressPageToMemoryIndex(end);
-    if (!startIndexOpt || !endIndexOpt) {
-        while(start < end) {
-            auto indexOpt = physicalAddressPageToMemoryIndex(start);
-            if(indexOpt) {
-                if (reserve) {
-                    physical_memory_bitmap[*indexOpt / 8] |= 1 << (*indexOpt % 8);
-                } else {
-                    physical_memory_bitmap[*indexOpt / 8] &= ~(1 << (*indexOpt % 8));
-                }
-            }
-            start.address += page_size;
-        }
+    uint64_t first = start.address & ~(page_size - 1);
+    uint64_t last = (start.address + size + (page_size - 1)) & ~(page_size - 1);
+    auto region_index = findRegion(first);
+    if (region_index == memory_region_count) region_index = 0;
+    // the range may span several regions and the holes between them
+    for (; region_index < memory_region_count && memory_regions[region_index].base < last; ++region_index) {
+        auto& region = memory_regions[region_index];
+        uint64_t region_end = region.base + region.page_count * page_size;
+        uint64_t overlap_start = first > region.base ? first : region.base;
+        uint64_t overlap_end = last < region_end ? last : region_end;
+        if (overlap_start >= overlap_end) continue;
+        setBitmapRange(region.first_index + (overlap_start - region.base) / page_size, (overlap_end - overlap_start) / page_size, reserve);
+    }
+}
+
+static FreeBlock* getFreeBlock(uint64_t address) {
+    if (map_physical_high) {
+        return PhysicalAddress(address).mapTmp().as<FreeBlock*>();
+    }
+    return reinterpret_cast<FreeBlock*>(address);
+}
+
+static bool testFreeBlock(uint64_t page_frame, uint8_t order) {
+    auto index = page_frame >> order;
+    return free_block_bitmaps[order][index / 8] & (1 << (index % 8));
+}
+
+static void setFreeBlock(uint64_t page_frame, uint8_t order, bool free) {
+    auto index = page_frame >> order;
+    if (free) {
+        free_block_bitmaps[order][index / 8] |= 1 << (index % 8);
     } else {
-        uint64_t startIndex = *startIndexOpt;
-        uint64_t endIndex = *endIndexOpt;
-        for (uint64_t index = startIndex; index < endIndex; ++index) {
-            if (reserve) {
-                physical_memory_bitmap[index / 8] |= 1 << (index % 8);
-            } else {
-                physical_memory_bitmap[index / 8] &= ~(1 << (index % 8));
-            }
+        free_block_bitmaps[order][index / 8] &= ~(1 << (index % 8));
+    }
+}
+
+static void pushFreeBlock(uint64_t address, uint8_t order) {
+    auto* block = getFreeBlock(address);
+    block->prev = 0;
+    block->next = free_lists[order];
+    if (free_lists[order]) {
+        getFreeBlock(free_lists[order])->prev = address;
+    }
+    free_lists[order] = address;
+    setFreeBlock(address / page_size, order, true);
+}
+
+static void removeFreeBlock(uint64_t address, uint8_t order) {
+    auto* block = getFreeBlock(address);
+    if (block->prev) {
+        getFreeBlock(block->prev)->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+    }
+    if (block->next) {
+        getFreeBlock(block->next)->prev = block->prev;
+    }
+    setFreeBlock(address / page_size, order, false);
+}
+
+static void freeBlock(uint64_t address, uint8_t order) {
+    uint64_t page_frame = address / page_size;
+    // merge with the buddy as long as it is a free block of the same order
+    while (order < max_order) {
+        uint64_t buddy = page_frame ^ (1ull << order);
+        if (buddy >= max_page_frame || !testFreeBlock(buddy, order)) break;
+        removeFreeBlock(buddy * page_size, order);
+        page_frame &= ~(1ull << order);
+        order++;
+    }
+    pushFreeBlock(page_frame * page_size, order);
+}
+
+static void freeRange(uint64_t address, uint64_t count) {
+    // split the range in the largest naturally aligned blocks
+    while (count > 0) {
+        uint64_t page_frame = address / page_size;
+        uint8_t order = 0;
+        while (order < max_order && (page_frame & (1ull << order)) == 0 && (2ull << order) <= count) {
+            order++;
+        }
+        freeBlock(address, order);
+        address += page_size << order;
+        count -= 1ull << order;
+    }
+}
+
+static optional<uint64_t> allocBlock(uint8_t order) {
+    uint8_t current = order;
+    while (current <= max_order && free_lists[current] == 0) {
+        current++;
+    }
+    if (current > max_order) return {};
+    uint64_t address = free_lists[current];
+    removeFreeBlock(address, current);
+    // split down to the requested order, the upper halves stay free
+    while (current > order) {
+        current--;
+        pushFreeBlock(address + (page_size << current), current);
+    }
+    return address;
+}
+
+static uint8_t orderForCount(uint64_t count) {
+    uint8_t order = 0;
+    while ((1ull << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+// adds all unallocated pages in [low, high) to the buddy free lists
+static void releaseFreePages(uint64_t low, uint64_t high) {
+    for (uint64_t region_index = 0; region_index < memory_region_count; ++region_index) {
+        auto& region = memory_regions[region_index];
+        uint64_t start = region.base > low ? region.base : low;
+        uint64_t end = region.base + region.page_count * page_size;
+        if (end > high) end = high;
+        if (start >= end) continue;
+        uint64_t index = region.first_index + (start - region.base) / page_size;
+        uint64_t end_index = region.first_index + (end - region.base) / page_size;
+        while (index < end_index) {
+            uint64_t run_start = findBitmap(index, end_index, false);
+            if (run_start == end_index) break;
+            uint64_t run_end = findBitmap(run_start, end_index, true);
+            freeRange(region.base + (run_start - region.first_index) * page_size, run_end - run_start);
+            index = run_end;
         }
     }
 }
@@ -144,53 +359,85 @@ void init(PhysicalAddress multiboot_info) {
     if (!entry) {
         panic("no memory info found");
     }
-    multiboot_memory_info_size = entry->size - sizeof(Entry);
-    if (multiboot_memory_info_size > page_size) {
-        panic("multiboot_memory_info_size > page_size");
-    }
-    memcpy(multiboot_memory_info, entry + 1, multiboot_memory_info_size);
+    multiboot_info_region = {multiboot_info.address, multiboot_info.address + multiboot2::getTotalSize(multiboot_info, false)};
 
-    // read memory
-    total_memory = 0;
-    uint32_t entry_size = *(uint32_t*) (multiboot_memory_info + 0);
-    uint32_t entry_version = *(uint32_t*) (multiboot_memory_info + 4);
-    uint8_t* entries = multiboot_memory_info + 8;
-    uint32_t entry_count = (multiboot_memory_info_size - 4) / entry_size;
+    // build the region table once, the memory map is not needed afterwards
+    auto* memory_info = reinterpret_cast<uint8_t*>(entry + 1);
+    uint32_t entry_size = *(uint32_t*) (memory_info + 0);
+    uint8_t* entries = memory_info + 8;
+    uint32_t entry_count = (entry->size - sizeof(Entry) - 8) / entry_size;
     struct MemoryMapEntry {
         uint64_t base_addr;
         uint64_t length;
         uint32_t type;
         uint32_t reserved;
     };
+    total_memory = 0;
+    max_page_frame = 0;
+    memory_region_count = 0;
     for (uint32_t index = 0; index < entry_count; ++index) {
-        auto* entry = (MemoryMapEntry*) (entries + index * entry_size);
-        if (entry->type == 1) {
-            total_memory += entry->length;
+        auto* map_entry = (MemoryMapEntry*) (entries + index * entry_size);
+        if (map_entry->type != 1) continue;
+        uint64_t start = (map_entry->base_addr + page_size - 1) & ~(page_size - 1);
+        uint64_t end = (map_entry->base_addr + map_entry->length) & ~(page_size - 1);
+        if (start >= end) continue;
+        if (memory_region_count == max_memory_region_count) {
+            panic("too many memory regions");
+        }
+        // insertion sort, the memory map is short and usually sorted already
+        uint64_t position = memory_region_count++;
+        while (position > 0 && memory_regions[position - 1].base > start) {
+            memory_regions[position] = memory_regions[position - 1];
+            position--;
         }
+        memory_regions[position] = {start, (end - start) / page_size, 0};
+        total_memory += end - start;
+        if (end / page_size > max_page_frame) max_page_frame = end / page_size;
+    }
+    physical_memory_bitmap_size = 0;
+    for (uint64_t index = 0; index < memory_region_count; ++index) {
+        memory_regions[index].first_index = physical_memory_bitmap_size;
+        physical_memory_bitmap_size += memory_regions[index].page_count;
     }
 
-    physical_memory_bitmap_size = total_memory / page_size;
+    // allocation bitmap followed by one free block bitmap per buddy order
+    uint64_t allocation_bitmap_bytes = (physical_memory_bitmap_size + 7) / 8;
+    uint64_t metadata_size = allocation_bitmap_bytes;
+    for (uint8_t order = 0; order <= max_order; ++order) {
+        metadata_size += ((max_page_frame >> order) + 8) / 8;
+    }
+    uint64_t share_counts_offset = (metadata_size + 7) & ~7ull;
+    metadata_size = share_counts_offset + physical_memory_bitmap_size * sizeof(uint16_t);
 
+    uint8_t* metadata = nullptr;
     [&]() {
-        for (uint32_t index = 0; index < entry_count; ++index) {
-            auto* entry = (MemoryMapEntry*) (entries + index * entry_size);
-            if (entry->type == 1) {
-                if (entry->length > physical_memory_bitmap_size && entry->base_addr + physical_memory_bitmap_size <= 1_Gi) {
-                    auto subregion = findSubregionWithSize({entry->base_addr, entry->base_addr + entry->length}, physical_memory_bitmap_size);
-                    if (subregion) {
-                        physical_memory_bitmap = (uint8_t*) subregion->left;
-                        return;
-                    }
+        for (uint64_t index = 0; index < memory_region_count; ++index) {
+            auto& region = memory_regions[index];
+            uint64_t region_size = region.page_count * page_size;
+            if (region_size > metadata_size && region.base + metadata_size <= 1_Gi) {
+                auto subregion = findSubregionWithSize({region.base, region.base + region_size}, metadata_size);
+                if (subregion) {
+                    metadata = (uint8_t*) subregion->left;
+                    return;
                 }
             }
         }
         panic("could not store memory bitmap");
     }();
-    memset(physical_memory_bitmap, 0, physical_memory_bitmap_size);
+    memset(metadata, 0, metadata_size);
+    physical_memory_bitmap = metadata;
+    uint8_t* next_bitmap = metadata + allocation_bitmap_bytes;
+    for (uint8_t order = 0; order <= max_order; ++order) {
+        free_block_bitmaps[order] = next_bitmap;
+        next_bitmap += ((max_page_frame >> order) + 8) / 8;
+        free_lists[order] = 0;
+    }
+    share_counts = reinterpret_cast<uint16_t*>(metadata + share_counts_offset);
+
     // mark used memory as 1
-    reserveMemory(PhysicalAddress{(uint64_t) physical_memory_bitmap}, physical_memory_bitmap_size);// bitmap
-    reserveMemory(PhysicalAddress{0}, page_size);                                                  // 0
-    reserveMemory(multiboot_info, multiboot2::getTotalSize(multiboot_info, false));                // multiboot info
+    reserveMemory(PhysicalAddress{(uint64_t) metadata}, metadata_size);                // bitmaps
+    reserveMemory(PhysicalAddress{0}, page_size);                                       // 0
+    reserveMemory(multiboot_info, multiboot2::getTotalSize(multiboot_info, false));     // multiboot info
     auto trampolineStart = saveReadSymbol("trampolineStart");
     auto trampolineEnd = saveReadSymbol("trampolineEnd");
     auto highPhysicalStart = saveReadSymbol("physical_start");
@@ -198,36 +445,258 @@ void init(PhysicalAddress multiboot_info) {
     reserveMemory(PhysicalAddress{trampolineStart}, trampolineEnd - trampolineStart);      // trampoline
     reserveMemory(PhysicalAddress{highPhysicalStart}, highPhysicalEnd - highPhysicalStart);// high physical
     reserveMemory(PhysicalAddress{0xA0000}, 0x100000 - 0xA0000);                           // Reserved ("Upper Memory")
-    last_checked_memory_bitmap_index = 0;
+
+    // only the first GiB is identity mapped until the page table is set up,
+    // memory above is handed to the buddy allocator in clear_startup
+    map_physical_high = false;
+    releaseFreePages(0, 1_Gi);
+}
+
+static optional<PhysicalAddress> allocGlobal(uint64_t count) {
+    auto order = orderForCount(count);
+    if (order > max_order) return {};
+    allocator_guard guard;
+    auto address = allocBlock(order);
+    if (!address) return {};
+    // give the unused tail of the block back, so an allocation only costs count pages
+    if ((1ull << order) > count) {
+        freeRange(*address + count * page_size, (1ull << order) - count);
+    }
+    reserveMemory(*address, count * page_size);
+    return PhysicalAddress{*address};
+}
+
+static void freeGlobal(PhysicalAddress address, uint64_t count) {
+    allocator_guard guard;
+    reserveMemory(address, count * page_size, false);
+    freeRange(address.address & ~(page_size - 1), count);
+}
+
+// moves a page in or out of a magazine, a page that is already on the requested side is freed twice
+static void setCached(uint64_t page, bool cached) {
+    auto index = physicalAddressPageToMemoryIndex(PhysicalAddress{page}).value_or_panic("magazine page outside of memory");
+    uint16_t expected = cached ? 0 : cached_page;
+    if (!__atomic_compare_exchange_n(&share_counts[index], &expected, cached ? cached_page : 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        panic(cached ? "PhysicalAllocator::free of a page that is still shared or already free" : "PhysicalAllocator magazine holds a page that is in use");
+    }
+}
+
+// magazine of the current cpu, nullptr until the cores are known
+static Magazine* currentMagazine() {
+    if (!APIC::get_cpu_local()) return nullptr;
+    auto os_id = APIC::get_cpu_number();
+    if (os_id >= max_cpu_count) return nullptr;
+    return &magazines[os_id];
+}
+
+// takes one batch from the buddy allocator, the pages stay marked as allocated while they are cached
+// the bitmap can't tell a cached page from a used one, their share count is cached_page instead
+static void refillMagazine(Magazine& magazine) {
+    allocator_guard guard;
+    if (auto block = allocBlock(magazine_batch_order)) {
+        reserveMemory(*block, magazine_batch * page_size);
+        for (uint64_t i = 0; i < magazine_batch; ++i) {
+            auto page = *block + (magazine_batch - 1 - i) * page_size;
+            setCached(page, true);
+            magazine.pages[magazine.count++] = page;
+        }
+    } else {
+        // fragmented memory, collect single pages instead
+        for (uint64_t i = 0; i < magazine_batch; ++i) {
+            auto page = allocBlock(0);
+            if (!page) break;
+            reserveMemory(*page, page_size);
+            setCached(*page, true);
+            magazine.pages[magazine.count++] = *page;
+        }
+    }
+    magazine.stats.refills++;
+}
+
+// returns the oldest batch of pages to the buddy allocator
+static void drainMagazine(Magazine& magazine) {
+    allocator_guard guard;
+    for (uint64_t i = 0; i < magazine_batch; ++i) {
+        setCached(magazine.pages[i], false);
+        reserveMemory(magazine.pages[i], page_size, false);
+        freeBlock(magazine.pages[i], 0);
+    }
+    magazine.count -= magazine_batch;
+    memcpy(magazine.pages, magazine.pages + magazine_batch, magazine.count * sizeof(uint64_t));
+    magazine.stats.drains++;
+}
+
+// returns every page cached on this cpu to the buddy allocator
+static void flushMagazine() {
+    auto flags = getFlags();
+    cli();
+    if (auto* magazine = currentMagazine()) {
+        allocator_guard guard;
+        for (uint64_t i = 0; i < magazine->count; ++i) {
+            setCached(magazine->pages[i], false);
+            reserveMemory(magazine->pages[i], page_size, false);
+            freeBlock(magazine->pages[i], 0);
+        }
+        magazine->count = 0;
+    }
+    setFlags(flags);
 }
 
 optional<PhysicalAddress> alloc(uint64_t count) {
-    auto stop_infinite_loop = last_checked_memory_bitmap_index;
-    do {
-        last_checked_memory_bitmap_index = (last_checked_memory_bitmap_index + 1) % physical_memory_bitmap_size;
-        int i = 0;
-        for (; i < count; ++i) {
-            uint64_t index = (last_checked_memory_bitmap_index + i) % physical_memory_bitmap_size;
-            if ((physical_memory_bitmap[index / 8] & (1 << (index % 8))) != 0) {// if bit is set -> page is allocated, try next
-                last_checked_memory_bitmap_index = index;
-                break;
+    if (count == 0) return {};
+    if (count == 1) {
+        // the magazine is per cpu, only interrupts on this core can interfere
+        auto flags = getFlags();
+        cli();
+        if (auto* magazine = currentMagazine()) {
+            if (magazine->count == 0) {
+                refillMagazine(*magazine);
+            } else {
+                magazine->stats.alloc_hits++;
             }
+            optional<PhysicalAddress> page;
+            if (magazine->count > 0) {
+                page = PhysicalAddress{magazine->pages[--magazine->count]};
+                setCached(page->address, false);
+            }
+            setFlags(flags);
+            return page;
         }
-        if (i == count) {
-            auto address = memoryBitmapIndexToPhysical(last_checked_memory_bitmap_index);
-            if (!address) return {};
-            reserveMemory(*address, count * page_size);
-            return address;
-        }
-    } while (stop_infinite_loop != last_checked_memory_bitmap_index);
-    return {};
+        setFlags(flags);
+    }
+    return allocGlobal(count);
 }
 
 void free(PhysicalAddress address, uint64_t count) {
-    reserveMemory(address, count * page_size, false);
+    if (count == 0) return;
+    auto index = physicalAddressPageToMemoryIndex(address);
+    if (!index || !testBitmap(*index) || share_counts[*index] == cached_page) {
+        panic("PhysicalAllocator::free of memory that is not allocated");
+    }
+    if (count == 1) {
+        auto flags = getFlags();
+        cli();
+        if (auto* magazine = currentMagazine()) {
+            if (magazine->count == magazine_size) {
+                drainMagazine(*magazine);
+            } else {
+                magazine->stats.free_hits++;
+            }
+            setCached(address.address & ~(page_size - 1), true);
+            magazine->pages[magazine->count++] = address.address & ~(page_size - 1);
+            setFlags(flags);
+            return;
+        }
+        setFlags(flags);
+    }
+    freeGlobal(address, count);
+}
+
+void add_reference(PhysicalAddress page) {
+    auto index = physicalAddressPageToMemoryIndex(page);
+    if (!index || !testBitmap(*index) || share_counts[*index] == cached_page) {
+        panic("PhysicalAllocator::add_reference of memory that is not allocated");
+    }
+    if (__atomic_add_fetch(&share_counts[*index], 1, __ATOMIC_SEQ_CST) >= cached_page) {
+        panic("too many references to a physical page");
+    }
+}
+
+void release(PhysicalAddress page) {
+    auto index = physicalAddressPageToMemoryIndex(page);
+    if (!index || !testBitmap(*index) || share_counts[*index] == cached_page) {
+        panic("PhysicalAllocator::release of memory that is not allocated");
+    }
+    uint16_t count = __atomic_load_n(&share_counts[*index], __ATOMIC_SEQ_CST);
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&share_counts[*index], &count, count - 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+    }
+    free(page, 1);
+}
+
+uint64_t reference_count(PhysicalAddress page) {
+    auto index = physicalAddressPageToMemoryIndex(page);
+    if (!index || !testBitmap(*index)) return 0;
+    auto shares = __atomic_load_n(&share_counts[*index], __ATOMIC_SEQ_CST);
+    return shares == cached_page ? 0 : 1 + shares;
 }
+
+MagazineStats magazine_stats() {
+    MagazineStats total{};
+    for (auto& magazine : magazines) {
+        total.alloc_hits += magazine.stats.alloc_hits;
+        total.free_hits += magazine.stats.free_hits;
+        total.refills += magazine.stats.refills;
+        total.drains += magazine.stats.drains;
+    }
+    return total;
+}
+
 void clear_startup() {
-    physical_memory_bitmap = PhysicalAddress((uint64_t)physical_memory_bitmap).mapTmp().as<uint8_t*>();
+    physical_memory_bitmap = PhysicalAddress((uint64_t) physical_memory_bitmap).mapTmp().as<uint8_t*>();
+    for (auto& bitmap : free_block_bitmaps) {
+        bitmap = PhysicalAddress((uint64_t) bitmap).mapTmp().as<uint8_t*>();
+    }
+    share_counts = PhysicalAddress((uint64_t) share_counts).mapTmp().as<uint16_t*>();
+    allocator_guard guard;
+    map_physical_high = true;
+    releaseFreePages(1_Gi, max_page_frame * page_size);
+}
+
+Test::Result test() {
+    auto single = alloc(1);
+    if (!single) return Test::Result::failure("could not allocate a single page");
+    auto single_index = physicalAddressPageToMemoryIndex(*single);
+    if (!single_index || !testBitmap(*single_index)) return Test::Result::failure("allocated page is not marked");
+    auto translated = memoryBitmapIndexToPhysical(*single_index);
+    if (!translated || *translated != *single) return Test::Result::failure("bitmap index translation is not reversible");
+    free(*single, 1);
+    auto again = alloc(1);
+    if (!again || *again != *single) return Test::Result::failure("freed page was not reused");
+    free(*again, 1);
+
+    auto huge = alloc(512);
+    if (!huge) return Test::Result::failure("could not allocate 2MiB");
+    if (huge->address % (512 * page_size) != 0) return Test::Result::failure("2MiB block is not naturally aligned");
+    auto odd = alloc(3);
+    if (!odd) return Test::Result::failure("could not allocate 3 pages");
+    if (odd->address >= huge->address && odd->address < huge->address + 512 * page_size) return Test::Result::failure("overlapping allocations");
+    free(*odd, 3);
+    free(*huge, 512);
+    auto merged = alloc(512);
+    if (!merged || *merged != *huge) return Test::Result::failure("buddies were not merged on free");
+    free(*merged, 512);
+
+    auto shared = alloc(1);
+    if (!shared) return Test::Result::failure("could not allocate a page to share");
+    add_reference(*shared);
+    if (reference_count(*shared) != 2) return Test::Result::failure("reference was not counted");
+    release(*shared);
+    if (reference_count(*shared) != 1) return Test::Result::failure("shared page lost its last owner");
+    release(*shared);
+    // the last release puts the page into the magazine of this cpu, where it stays marked as allocated
+    flushMagazine();
+    if (reference_count(*shared) != 0) return Test::Result::failure("released page is still allocated");
+
+    // a batch of single pages goes through the magazine of this cpu
+    PhysicalAddress pages[magazine_batch];
+    auto before = magazine_stats();
+    for (auto& page : pages) {
+        auto result = alloc(1);
+        if (!result) return Test::Result::failure("could not allocate a cached page");
+        page = *result;
+    }
+    for (auto& page : pages) {
+        free(page, 1);
+    }
+    auto after = magazine_stats();
+    if (currentMagazine() && after.alloc_hits + after.refills == before.alloc_hits + before.refills) {
+        return Test::Result::failure("single pages bypassed the magazine");
+    }
+    Log::printf(Log::Debug, "PhysicalAllocator", "magazine hits alloc %i free %i, refills %i, drains %i\n", after.alloc_hits, after.free_hits, after.refills, after.drains);
+    return Test::Result::success();
 }
 
 }// namespace PhysicalAllocator
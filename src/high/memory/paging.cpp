@@ -1,14 +1,78 @@
 #include "memory/paging.h"
+#include "ACPI/APIC.h"
 #include "asm/regs.h"
+#include "asm/util.h"
 #include "features/bytes.h"
+#include "features/lock.h"
 #include "interrupt/interrupt.h"
 #include "memory/mem.h"
 #include "out/panic.h"
+#include "test/test.h"
 
 
 namespace PageTable {
 
 static bool map_physical_high = false;
+static PhysicalAddress kernel_space;
+
+// the kernel half starts at 32TiB, its level 3 tables exist from init on and are shared by all address spaces
+static constexpr uint64_t kernel_half_first_entry = 32_Ti / 512_Gi;
+static constexpr uint64_t kernel_half_end_entry = 256;
+
+// an address space is the value loaded into cr3: the level 4 table and, with pcid support, the pcid in the low 12 bits
+static constexpr uint64_t pcid_mask = page_size - 1;
+static constexpr uint64_t cr3_no_flush = 1ull << 63;
+static constexpr uint64_t cr4_pcide = 1ull << 17;
+static constexpr uint64_t cr4_pge = 1ull << 7;
+static bool pcid_enabled = false;
+
+// passed as size to invalidate every tlb entry of every pcid
+static constexpr uint64_t all_contexts = ~0ull;
+// passed as size to drop the cached page tables of the kernel half, global tlb entries stay
+static constexpr uint64_t kernel_tables = ~1ull;
+
+// pcids are handed out in order, a released pcid is only reused after every core flushed all contexts once
+static constexpr uint16_t pcid_count = 4096;
+static spinlock pcid_lock{"pcid"};
+static uint16_t next_pcid = 1;
+static uint16_t released_pcids[pcid_count];
+static uint16_t released_count = 0;
+static uint16_t free_pcids[pcid_count];
+static uint16_t free_count = 0;
+static bool reclaiming_pcids = false;
+
+// 0 is the pcid of the kernel space, spaces that get it share the tag and are flushed on every switch
+static uint16_t allocatePCID() {
+    if (!pcid_enabled) return 0;
+    uint16_t reclaimed;
+    {
+        lock_guard guard(pcid_lock);
+        if (free_count > 0) return free_pcids[--free_count];
+        if (next_pcid < pcid_count) return next_pcid++;
+        if (released_count == 0 || reclaiming_pcids) return 0;
+        reclaiming_pcids = true;
+        reclaimed = released_count;
+    }
+    // the lock is not held while the other cores flush, they may wait for it with interrupts disabled
+    invalidate_all();
+    lock_guard guard(pcid_lock);
+    for (uint16_t i = 0; i < reclaimed; ++i) {
+        free_pcids[free_count++] = released_pcids[i];
+    }
+    // pcids released during the flush stay behind for the next round
+    for (uint16_t i = reclaimed; i < released_count; ++i) {
+        released_pcids[i - reclaimed] = released_pcids[i];
+    }
+    released_count -= reclaimed;
+    reclaiming_pcids = false;
+    return free_pcids[--free_count];
+}
+
+static void releasePCID(uint16_t pcid) {
+    if (pcid == 0) return;
+    lock_guard guard(pcid_lock);
+    released_pcids[released_count++] = pcid;
+}
 
 static optional<PageTableEntry*> getPageEntry(PageTable* page, uint64_t index) {
     if (index < 512) {
@@ -17,14 +81,22 @@ static optional<PageTableEntry*> getPageEntry(PageTable* page, uint64_t index) {
     return {};
 }
 
-static PageTable* getL4() {
+static PhysicalAddress levelFourTable(PhysicalAddress space) {
+    return PhysicalAddress{space.address & ~pcid_mask};
+}
+
+static PageTable* getL4(PhysicalAddress space) {
     if (map_physical_high) {
-        return PhysicalAddress(getCR3()).mapTmp().as<PageTable*>();
+        return levelFourTable(space).mapTmp().as<PageTable*>();
     } else {
-        return reinterpret_cast<PageTable*>(getCR3());
+        return reinterpret_cast<PageTable*>(levelFourTable(space).address);
     }
 }
 
+static PageTable* getL4() {
+    return getL4(current_address_space());
+}
+
 static optional<PageTable*> getPage(PageTableEntry* entry) {
     if (entry->present) {
         return entry->address().mapTmp().as<PageTable*>();
@@ -41,6 +113,239 @@ static PageTable* allocatePage() {
     return page;
 }
 
+// size of the memory a leaf at this level maps: 1 = 4KiB, 2 = 2MiB, 3 = 1GiB
+static constexpr uint64_t levelPageSize(uint8_t level) {
+    return page_size << (9 * (level - 1));
+}
+
+static uint64_t tableAddress(PageTable* page) {
+    return get(VirtualAddress(page)).value_or_panic("Can not unmap tmp mapped memory").address;
+}
+
+// replaces a huge page with a table of 512 entries of the next smaller size that map the same memory
+static void splitHugePage(PageTableEntry* entry, uint8_t level) {
+    auto* table = allocatePage();
+    uint64_t childSize = levelPageSize(level - 1);
+    for (uint64_t i = 0; i < 512; ++i) {
+        auto& child = table->entries[i];
+        child.raw = entry->raw;
+        child.addressAndReserved = (entry->address().address + i * childSize) >> 12;
+        child.pageSize = level - 1 > 1;
+    }
+    entry->addressAndReserved = tableAddress(table) >> 12;
+    entry->pageSize = 0;
+    entry->metaData2 = 512;
+}
+
+// frees the table the entry points to and all tables below it, the mapped memory is not touched
+// with releasePages every 4KiB page mapped below entry loses the reference of this table, huge pages are only used by the kernel half
+static void freeTable(PageTableEntry* entry, uint8_t level, bool releasePages = false) {
+    auto* table = entry->address().mapTmp().as<PageTable*>();
+    if (level > 2) {
+        for (auto& child : table->entries) {
+            if (child.present && !child.pageSize) {
+                freeTable(&child, level - 1, releasePages);
+            }
+        }
+    } else if (releasePages) {
+        for (auto& leaf : table->entries) {
+            if (leaf.present) {
+                PhysicalAllocator::release(leaf.address());
+            }
+        }
+    }
+    PhysicalAllocator::free(entry->address(), 1);
+}
+
+// avl bit of a leaf that was made read only because its page is shared, the first write copies it
+static constexpr uint64_t copy_on_write_bit = 1;
+
+// what a walk changed, the caller invalidates accordingly
+static constexpr uint8_t entries_changed = 1;// a translation that may be cached in a tlb changed
+static constexpr uint8_t tables_freed = 2;   // a cached page table may point to a freed page
+
+static void checkGlobal(VirtualAddress v, Flags f) {
+    if (f.global != (v.address >= 32_Ti)) {
+        panic("kernel half mappings have to be global and program half mappings must not be");
+    }
+}
+
+static void invalidateChanges(PhysicalAddress space, VirtualAddress v, uint64_t size, uint8_t changes) {
+    if ((changes & tables_freed) && v.address >= 32_Ti) {
+        // tables of the kernel half may be cached under any pcid
+        invalidate_all();
+    } else if (changes) {
+        invalidate(space, v, size);
+    }
+}
+
+// an entry that points to a table counts the present entries of that table in its upper avl bits (metaData2),
+// parent is that entry for the table of entry, nullptr for the level 4 table which is never freed
+static void countEntry(PageTableEntry* parent, int delta) {
+    if (!parent) return;
+    if (delta < 0 && parent->metaData2 == 0) return;// a table nobody counted, it is never reclaimed
+    parent->metaData2 += delta;
+}
+
+// sets the count of every table below table from its content, for tables created before init
+static uint16_t recountTable(PageTable* table, uint8_t level) {
+    uint16_t live = 0;
+    for (auto& entry : table->entries) {
+        if (!entry.present) continue;
+        live++;
+        if (level > 1 && !entry.pageSize) {
+            entry.metaData2 = recountTable(getPage(&entry).value(), level - 1);
+        }
+    }
+    return live;
+}
+
+// the count can be wrong for tables that were filled without this file, so an empty table is checked before it is freed
+static bool isEmptyTable(PageTableEntry* entry) {
+    if (entry->metaData2 != 0) return false;
+    for (auto& child : getPage(entry).value()->entries) {
+        if (child.present) return false;
+    }
+    return true;
+}
+
+// returns true if a translation that may be cached in a tlb changed
+static bool setLeaf(PageTableEntry* parent, PageTableEntry* entry, PhysicalAddress p, Flags f, bool huge) {
+    PageTableEntry old = *entry;
+    if (!old.present) {
+        countEntry(parent, 1);
+    }
+    entry->addressAndReserved = p.address >> 12;
+    entry->present = 1;
+    entry->writeEnabled = f.writeable;
+    entry->userAllowed = f.user;
+    entry->writeThrough = f.writeThrough;
+    entry->cacheDisabled = f.cacheDisabled;
+    entry->pageSize = huge;
+    entry->global = f.global;
+    return old.present && old.raw != entry->raw;
+}
+
+// returns the table the entry points to, a missing table is allocated and a huge page is split
+static PageTable* descend(PageTableEntry* parent, PageTableEntry* entry, uint8_t level, Flags f) {
+    if (entry->present && entry->pageSize) {
+        splitHugePage(entry, level);
+    }
+    auto page = getPage(entry).value_or_create(allocatePage);
+    if (!entry->present) {
+        entry->addressAndReserved = tableAddress(page) >> 12;
+        entry->metaData2 = 0;
+        countEntry(parent, 1);
+    }
+    entry->present = 1;
+    entry->writeEnabled |= f.writeable;
+    entry->userAllowed |= f.user;
+    entry->writeThrough |= f.writeThrough;
+    entry->cacheDisabled |= f.cacheDisabled;
+    return page;
+}
+
+// returns the table at the given level for v, parent is set to the entry that points to it
+static PageTable* walkCreate(PageTable* l4, VirtualAddress v, uint8_t level, Flags f, PageTableEntry*& parent) {
+    PageTable* currentPage = l4;
+    parent = nullptr;
+    for (uint8_t currentLevel = 4; currentLevel > level; --currentLevel) {
+        auto* entry = getPageEntry(currentPage, v.getOffset(currentLevel).value()).value();
+        currentPage = descend(parent, entry, currentLevel, f);
+        parent = entry;
+    }
+    return currentPage;
+}
+
+// returns the present 4KiB leaf for v, huge pages on the way are split
+static PageTableEntry* findLeaf(PageTable* l4, VirtualAddress v) {
+    PageTable* currentPage = l4;
+    for (uint8_t level = 4; level > 1; --level) {
+        auto* entry = getPageEntry(currentPage, v.getOffset(level).value()).value();
+        if (!entry->present) return nullptr;
+        if (entry->pageSize) {
+            splitHugePage(entry, level);
+        }
+        currentPage = getPage(entry).value();
+    }
+    auto* entry = getPageEntry(currentPage, v.l1Offset).value();
+    return entry->present ? entry : nullptr;
+}
+
+// maps [start, end) to p using the entries of one table, every table below is visited once
+// returns entries_changed and tables_freed as far as they happened
+static uint8_t mapRange(PageTableEntry* parent, PageTable* table, uint8_t level, PhysicalAddress p, uint64_t start, uint64_t end, Flags f) {
+    uint64_t entrySize = levelPageSize(level);
+    uint8_t changed = 0;
+    while (start < end) {
+        auto* entry = getPageEntry(table, VirtualAddress(start).getOffset(level).value()).value();
+        uint64_t entryEnd = (start & ~(entrySize - 1)) + entrySize;
+        uint64_t chunkEnd = entryEnd < end ? entryEnd : end;
+        if (level == 1) {
+            changed |= setLeaf(parent, entry, p, f, false) ? entries_changed : 0;
+        } else if (level <= 3 && start % entrySize == 0 && p.address % entrySize == 0 && chunkEnd == entryEnd) {
+            // the huge page replaces everything an old table mapped
+            if (entry->present && !entry->pageSize) {
+                freeTable(entry, level);
+                changed |= entries_changed | tables_freed;
+            }
+            changed |= setLeaf(parent, entry, p, f, true) ? entries_changed : 0;
+        } else {
+            auto* child = descend(parent, entry, level, f);
+            changed |= mapRange(entry, child, level - 1, p, start, chunkEnd, f);
+        }
+        p.address += chunkEnd - start;
+        start = chunkEnd;
+    }
+    return changed;
+}
+
+// returns entries_changed and tables_freed as far as they happened
+// tables that became empty are unlinked and pushed to freedTables (linked through their first bytes),
+// they may only be freed after the tlbs were invalidated
+static uint8_t unmapRange(PageTableEntry* parent, PageTable* table, uint8_t level, uint64_t start, uint64_t end, uint64_t& freedTables) {
+    uint8_t changed = 0;
+    uint64_t entrySize = levelPageSize(level);
+    while (start < end) {
+        auto* entry = getPageEntry(table, VirtualAddress(start).getOffset(level).value()).value();
+        uint64_t entryEnd = (start & ~(entrySize - 1)) + entrySize;
+        uint64_t chunkEnd = entryEnd < end ? entryEnd : end;
+        if (entry->present) {
+            if (level == 1 || (entry->pageSize && start % entrySize == 0 && chunkEnd == entryEnd)) {
+                entry->present = 0;
+                countEntry(parent, -1);
+                changed |= entries_changed;
+            } else {
+                if (entry->pageSize) {
+                    // partial unmap of a huge page, keep the rest of it mapped
+                    splitHugePage(entry, level);
+                }
+                changed |= unmapRange(entry, getPage(entry).value(), level - 1, start, chunkEnd, freedTables);
+                // the level 3 tables of the kernel half are shared by all address spaces and stay
+                bool shared = level == 4 && start >= 32_Ti;
+                if (!shared && isEmptyTable(entry)) {
+                    auto page = entry->address();
+                    *page.mapTmp().as<uint64_t*>() = freedTables;
+                    freedTables = page.address;
+                    entry->raw = 0;
+                    countEntry(parent, -1);
+                    changed |= tables_freed;
+                }
+            }
+        }
+        start = chunkEnd;
+    }
+    return changed;
+}
+
+static void freeTables(uint64_t tables) {
+    while (tables) {
+        uint64_t next = *PhysicalAddress{tables}.mapTmp().as<uint64_t*>();
+        PhysicalAllocator::free(PhysicalAddress{tables}, 1);
+        tables = next;
+    }
+}
+
 static PageMetaData constructMetaData(PageTableEntry* entry) {
     PageMetaData meta{};
     meta.data = entry->metaData;
@@ -77,47 +382,268 @@ void init() {
             entry.present = 1;
             entry.writeEnabled = 1;
             entry.pageSize = 1;
+            entry.global = 1;
         }
     }
+    kernel_space = current_address_space();
+    // every later address space copies the kernel half of the level 4 table, so it may never change again
+    for (uint64_t i = kernel_half_first_entry; i < kernel_half_end_entry; ++i) {
+        auto& entry = level4->entries[i];
+        if (entry.present) continue;
+        entry.raw = 0;
+        entry.addressAndReserved = tableAddress(allocatePage()) >> 12;
+        entry.present = 1;
+        entry.writeEnabled = 1;
+    }
+    recountTable(level4, 4);
+    uint32_t features, extendedFeatures;
+    cpuid(1, nullptr, nullptr, &features, nullptr);
+    cpuid(7, 0, nullptr, &extendedFeatures, nullptr, nullptr);
+    // pcids are only used together with invpcid, invalidating a space that is not loaded needs it
+    pcid_enabled = (features & (1 << 17)) && (extendedFeatures & (1 << 10));
+    init_core();
+}
+
+void init_core() {
+    // without write protect the kernel, which runs the processes, would write to copy on write pages
+    setCR0(getCR0() | (1 << 16));
+    uint64_t cr4 = getCR4() | cr4_pge;
+    if (pcid_enabled) {
+        cr4 |= cr4_pcide;
+    }
+    setCR4(cr4);
+}
+
+PhysicalAddress create_address_space() {
+    auto* table = allocatePage();
+    auto* kernel = getL4(kernel_space);
+    for (uint64_t i = kernel_half_first_entry; i < kernel_half_end_entry; ++i) {
+        table->entries[i] = kernel->entries[i];
+    }
+    return tableAddress(table) | allocatePCID();
+}
+
+void destroy_address_space(PhysicalAddress space) {
+    if (space == kernel_space) {
+        panic("can not destroy the kernel address space");
+    }
+    if (space == current_address_space()) {
+        switch_address_space(kernel_space);
+    }
+    auto* table = getL4(space);
+    for (uint64_t i = 0; i < kernel_half_first_entry; ++i) {
+        if (table->entries[i].present) {
+            freeTable(&table->entries[i], 4, true);
+        }
+    }
+    PhysicalAllocator::free(levelFourTable(space), 1);
+    releasePCID(space.address & pcid_mask);
+}
+
+void switch_address_space(PhysicalAddress space) {
+    if (space == current_address_space()) return;
+    uint64_t cr3 = space.address;
+    if (pcid_enabled && (space.address & pcid_mask) != 0) {
+        // the entries of this pcid were kept up to date while it was not loaded
+        cr3 |= cr3_no_flush;
+    }
+    setCR3(cr3);
+}
+
+PhysicalAddress current_address_space() {
+    return PhysicalAddress{getCR3() & ~cr3_no_flush};
+}
+
+PhysicalAddress kernel_address_space() {
+    return kernel_space;
 }
 void map(PhysicalAddress p, VirtualAddress v, Flags f) {
-    PageTable* currentPage = getL4();
-    uint8_t level = 4;
-    PageTableEntry* entry = nullptr;
-    while (level > 1) {// 4 -> 3 -> 2 -> 1
-        entry = getPageEntry(currentPage, v.getOffset(level).value()).value();
-        auto page = getPage(entry).value_or_create(allocatePage);
-        if (!entry->present) {
-            entry->addressAndReserved = get(VirtualAddress(page)).value_or_panic("Can not unmap tmp mapped memory").address >> 12;
-        }
-        entry->present = 1;
-        entry->writeEnabled |= f.writeable;
-        entry->userAllowed |= f.user;
-        entry->writeThrough |= f.writeThrough;
-        entry->cacheDisabled |= f.cacheDisabled;
-        currentPage = page;
-        level--;
-    }
-    entry = getPageEntry(currentPage, v.getOffset(1).value()).value();
-    entry->addressAndReserved = p.address >> 12;
-    entry->present = 1;
-    entry->writeEnabled = f.writeable;
-    entry->userAllowed = f.user;
-    entry->writeThrough = f.writeThrough;
-    entry->cacheDisabled = f.cacheDisabled;
+    checkGlobal(v, f);
+    PageTableEntry* parent;
+    auto* table = walkCreate(getL4(), v, 1, f, parent);
+    if (setLeaf(parent, getPageEntry(table, v.l1Offset).value(), p, f, false)) {
+        invalidate(current_address_space(), v, page_size);
+    }
+}
+
+void map_huge(PhysicalAddress p, VirtualAddress v, uint8_t level, Flags f) {
+    if (level != 2 && level != 3) {
+        panic("huge pages are only supported on level 2 and 3");
+    }
+    if (p.address % levelPageSize(level) != 0 || v.address % levelPageSize(level) != 0) {
+        panic("huge page is not aligned");
+    }
+    checkGlobal(v, f);
+    PageTableEntry* parent;
+    auto* table = walkCreate(getL4(), v, level, f, parent);
+    auto* entry = getPageEntry(table, v.getOffset(level).value()).value();
+    uint8_t changed = 0;
+    if (entry->present && !entry->pageSize) {
+        // the huge page replaces everything the old table mapped
+        freeTable(entry, level);
+        changed |= entries_changed | tables_freed;
+    }
+    changed |= setLeaf(parent, entry, p, f, true) ? entries_changed : 0;
+    invalidateChanges(current_address_space(), v, levelPageSize(level), changed);
+}
+
+void map_range(PhysicalAddress p, VirtualAddress v, uint64_t size, Flags f) {
+    map_range(current_address_space(), p, v, size, f);
+}
+
+void map_range(PhysicalAddress space, PhysicalAddress p, VirtualAddress v, uint64_t size, Flags f) {
+    size += v.address % page_size;
+    p.address &= ~(page_size - 1);
+    v.address &= ~(page_size - 1);
+    uint64_t end = (v.address + size + page_size - 1) & ~(page_size - 1);
+    checkGlobal(v, f);
+    invalidateChanges(space, v, end - v.address, mapRange(nullptr, getL4(space), 4, p, v.address, end, f));
+}
+
+void share_range(PhysicalAddress from_space, VirtualAddress from, PhysicalAddress to_space, VirtualAddress to, uint64_t size, Flags f) {
+    if (from.address % page_size != 0 || to.address % page_size != 0 || size % page_size != 0) {
+        panic("shared ranges have to be page aligned");
+    }
+    checkGlobal(to, f);
+    Flags readOnly = f;
+    readOnly.writeable = false;
+    bool sourceChanged = false;
+    bool targetChanged = false;
+    for (uint64_t offset = 0; offset < size; offset += page_size) {
+        auto* source = findLeaf(getL4(from_space), from + offset);
+        if (!source) continue;
+        if (source->writeEnabled) {
+            source->writeEnabled = 0;
+            source->metaData |= copy_on_write_bit;
+            sourceChanged = true;
+        }
+        PhysicalAllocator::add_reference(source->address());
+        PageTableEntry* parent;
+        auto* table = walkCreate(getL4(to_space), to + offset, 1, f, parent);
+        auto* target = getPageEntry(table, (to + offset).l1Offset).value();
+        targetChanged |= setLeaf(parent, target, source->address(), readOnly, false);
+        if (f.writeable) {
+            target->metaData |= copy_on_write_bit;
+        } else {
+            target->metaData &= ~copy_on_write_bit;
+        }
+    }
+    if (sourceChanged) {
+        invalidate(from_space, from, size);
+    }
+    if (targetChanged) {
+        invalidate(to_space, to, size);
+    }
+}
+
+bool copy_on_write(PhysicalAddress space, VirtualAddress v) {
+    auto* entry = findLeaf(getL4(space), v);
+    if (!entry || !(entry->metaData & copy_on_write_bit)) return false;
+    auto page = entry->address();
+    if (PhysicalAllocator::reference_count(page) > 1) {
+        auto copy = PhysicalAllocator::alloc(1);
+        if (!copy) return false;
+        memcpy(copy->mapTmp().as<void*>(), page.mapTmp().as<void*>(), page_size);
+        entry->addressAndReserved = copy->address >> 12;
+        PhysicalAllocator::release(page);
+    }
+    // the last owner keeps the page
+    entry->writeEnabled = 1;
+    entry->metaData &= ~copy_on_write_bit;
+    invalidate(space, v, page_size);
+    return true;
+}
+
+void unmap_range(VirtualAddress v, uint64_t size) {
+    unmap_range(current_address_space(), v, size);
+}
+
+void unmap_range(PhysicalAddress space, VirtualAddress v, uint64_t size) {
+    size += v.address % page_size;
+    v.address &= ~(page_size - 1);
+    uint64_t end = (v.address + size + page_size - 1) & ~(page_size - 1);
+    uint64_t freedTables = 0;
+    invalidateChanges(space, v, end - v.address, unmapRange(nullptr, getL4(space), 4, v.address, end, freedTables));
+    freeTables(freedTables);
 }
 
 void unmap(VirtualAddress v) {
-    auto entry = optional(getL4())
-                         .map<PageTableEntry*>(getPageEntry, v.l4Offset)
-                         .map<PageTable*>(getPage)
-                         .map<PageTableEntry*>(getPageEntry, v.l3Offset)
-                         .map<PageTable*>(getPage)
-                         .map<PageTableEntry*>(getPageEntry, v.l2Offset)
-                         .map<PageTable*>(getPage)
-                         .map<PageTableEntry*>(getPageEntry, v.l1Offset);
-    if (!entry) return;
-    entry.value()->present = 0;
+    unmap_range(v, page_size);
+}
+
+// above this many pages reloading cr3 is cheaper than invalidating every page
+static constexpr uint64_t invalidate_page_threshold = 32;
+
+static void flushEverything() {
+    if (pcid_enabled) {
+        invpcid(2, 0, 0);
+        return;
+    }
+    // toggling pge drops every entry including the global ones
+    uint64_t cr4 = getCR4();
+    setCR4(cr4 ^ cr4_pge);
+    setCR4(cr4);
+}
+
+void invalidate_local(PhysicalAddress space, VirtualAddress v, uint64_t size) {
+    if (size == all_contexts) {
+        flushEverything();
+        return;
+    }
+    if (size == kernel_tables) {
+        if (pcid_enabled) {
+            // tables of the kernel half may be cached under any pcid, type 3 drops them for all pcids and keeps global entries
+            invpcid(3, 0, 0);
+        } else {
+            // invlpg drops every cached table of the loaded space, the last cr3 switch dropped those of the others
+            invlpg(v.as<void*>());
+        }
+        return;
+    }
+    uint64_t first = v.address & ~(page_size - 1);
+    uint64_t pages = (v.address + size - first + page_size - 1) / page_size;
+    if (v.address >= 32_Ti) {
+        // kernel half leaves are global, invlpg drops them whatever pcid is loaded
+        if (pages > invalidate_page_threshold) {
+            flushEverything();
+            return;
+        }
+        for (uint64_t i = 0; i < pages; ++i) {
+            invlpg(reinterpret_cast<void*>(first + i * page_size));
+        }
+        return;
+    }
+    // without pcids every switch flushes the program half, so only the loaded space can have entries for it
+    if (!pcid_enabled && space != current_address_space()) return;
+    uint64_t pcid = space.address & pcid_mask;
+    if (pages > invalidate_page_threshold) {
+        if (pcid_enabled) {
+            invpcid(1, pcid, 0);
+        } else {
+            setCR3(getCR3());
+        }
+        return;
+    }
+    for (uint64_t i = 0; i < pages; ++i) {
+        if (pcid_enabled) {
+            invpcid(0, pcid, first + i * page_size);
+        } else {
+            invlpg(reinterpret_cast<void*>(first + i * page_size));
+        }
+    }
+}
+
+void invalidate(PhysicalAddress space, VirtualAddress v, uint64_t size) {
+    invalidate_local(space, v, size);
+    APIC::shootdown_tlb(space, v, size);
+}
+
+void invalidate_all() {
+    invalidate(kernel_space, 0, all_contexts);
+}
+
+void invalidate_kernel_tables(VirtualAddress v) {
+    invalidate(kernel_space, v, kernel_tables);
 }
 
 optional<PhysicalAddress> get(VirtualAddress v) {
@@ -130,21 +656,21 @@ optional<PhysicalAddress> get(VirtualAddress v) {
     auto l3 = getPage(entry.value());
     if (!l3) return {};
     entry = getPageEntry(l3.value(), v.l3Offset);
-    if (!entry) return {};
+    if (!entry || !entry.value()->present) return {};
     if (entry.value()->pageSize == 1) {
         return PhysicalAddress{entry.value()->address().address + v.offset + v.l1Offset * 4_Ki + v.l2Offset * 2_Mi};
     }
     auto l2 = getPage(entry.value());
     if (!l2) return {};
     entry = getPageEntry(l2.value(), v.l2Offset);
-    if (!entry) return {};
+    if (!entry || !entry.value()->present) return {};
     if (entry.value()->pageSize == 1) {
         return PhysicalAddress{entry.value()->address().address + v.offset + v.l1Offset * 4_Ki};
     }
     auto l1 = getPage(entry.value());
     if (!l1) return {};
     entry = getPageEntry(l1.value(), v.l1Offset);
-    if (!entry) return {};
+    if (!entry || !entry.value()->present) return {};
     return PhysicalAddress{entry.value()->address().address + v.offset};
 }
 
@@ -175,22 +701,30 @@ bool setMetaData(VirtualAddress v, uint8_t level, PageMetaData metaData, bool al
     }
     uint8_t currentLevel = 4;
     auto* currentPage = getL4();
+    PageTableEntry* parent = nullptr;
     while (currentLevel > 0) {
         auto entry = getPageEntry(currentPage, v.getOffset(currentLevel)).value();
         if (currentLevel == level) {
+            // the avl bits of an entry that points to a table hold the count of its present entries
+            if (level > 1 && entry->present && !entry->pageSize) return false;
             entry->metaData = metaData.data;
             entry->metaData2 = metaData.data >> 3;
             return true;
         }
+        if (entry->present && entry->pageSize) return false;// a huge page has no entries below
         auto nextPage = getPage(entry);
         if (!nextPage && !allocateIfNotPresent) return false;
         if (!nextPage) {
             nextPage = allocatePage();
             entry->addressAndReserved = nextPage >> 12;
+            entry->metaData2 = 0;
             entry->present = 1;
             entry->writeEnabled = 1;
+            countEntry(parent, 1);
         }
+        parent = entry;
         currentPage = nextPage.value();
+        currentLevel--;
     }
     return false;
 }
@@ -202,8 +736,101 @@ void clear_startup() {
     map_physical_high = true;
     auto l4 = getL4();
     l4->entries[0].raw = 0;
+    invalidate(kernel_space, 0, 512_Gi);
     Interrupt::clear_startup();
 }
 
+Test::Result test() {
+    constexpr VirtualAddress base = 40_Ti;
+    constexpr Flags flags{.writeable = true, .user = false, .writeThrough = false, .cacheDisabled = false, .global = true};
+    constexpr Flags programFlags{.writeable = true, .user = false, .writeThrough = false, .cacheDisabled = false};
+    auto phys = PhysicalAllocator::alloc(2_Mi / page_size);
+    if (!phys) return Test::Result::failure("could not allocate 2MiB");
+
+    map_range(*phys, base, 2_Mi, flags);
+    auto level2 = getPage(getPageEntry(getPage(getPageEntry(getL4(), base.l4Offset).value()).value(), base.l3Offset).value()).value();
+    if (!level2->entries[base.l2Offset].pageSize) return Test::Result::failure("aligned range was not mapped with a huge page");
+    if (get(base + 1_Mi + 123).value_or(0) != PhysicalAddress{phys->address + 1_Mi + 123}) return Test::Result::failure("wrong translation inside huge page");
+
+    // unmapping one page splits the huge page and keeps the rest mapped
+    unmap(base + 4_Ki);
+    if (level2->entries[base.l2Offset].pageSize) return Test::Result::failure("huge page was not split");
+    if (get(base + 4_Ki)) return Test::Result::failure("unmapped page is still mapped");
+    if (get(base + 8_Ki).value_or(0) != PhysicalAddress{phys->address + 8_Ki}) return Test::Result::failure("split changed the translation");
+
+    unmap_range(base, 2_Mi);
+    if (get(base + 8_Ki)) return Test::Result::failure("unmap_range left a page mapped");
+    auto level3 = getPage(getPageEntry(getL4(), base.l4Offset).value()).value();
+    if (level3->entries[base.l3Offset].present) return Test::Result::failure("empty page tables were not reclaimed");
+
+    // compare a 1MiB mapping done page by page with the batched walk
+    constexpr uint64_t count = 1_Mi / page_size;
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < count; ++i) {
+        map(phys->address + i * page_size, base + i * page_size, flags);
+    }
+    uint64_t single = rdtsc() - start;
+    unmap_range(base, 1_Mi);
+    start = rdtsc();
+    map_range(*phys, base, 1_Mi, flags);
+    uint64_t batched = rdtsc() - start;
+    if (get(base + 1_Mi - page_size).value_or(0) != PhysicalAddress{phys->address + 1_Mi - page_size}) return Test::Result::failure("wrong translation after map_range");
+    // the avl bits of an entry that points to a table hold its count, metadata only goes to pages
+    if (setMetaData(base, 2, PageMetaData{0x3FFF}, false)) return Test::Result::failure("metadata overwrote the count of a page table");
+    if (!setMetaData(base, 1, PageMetaData{5}, false) || getMetaData(base, 1).value().data != 5) return Test::Result::failure("metadata of a page was not kept");
+    unmap_range(base, 1_Mi);
+    if (level3->entries[base.l3Offset].present) return Test::Result::failure("page tables were not reclaimed after setting metadata");
+    Log::printf(Log::Info, "PageTable", "mapping 1MiB: %i cycles page by page, %i cycles batched\n", single, batched);
+
+    // remapping a page of a space that is not loaded has to reach the entries tagged with its pcid
+    auto space = create_address_space();
+    constexpr VirtualAddress programPage = 1_Gi;
+    map_range(space, *phys, programPage, page_size, programFlags);
+    auto previous = current_address_space();
+    switch_address_space(space);
+    *programPage.as<volatile uint64_t*>() = 1;
+    switch_address_space(previous);
+    map_range(space, phys->address + page_size, programPage, page_size, programFlags);
+    switch_address_space(space);
+    *programPage.as<volatile uint64_t*>() = 2;
+    switch_address_space(previous);
+    uint64_t first = *(*phys).mapTmp().as<volatile uint64_t*>();
+    uint64_t second = *PhysicalAddress{phys->address + page_size}.mapTmp().as<volatile uint64_t*>();
+    // the pages belong to the test, destroying the space would release them
+    unmap_range(space, programPage, page_size);
+    destroy_address_space(space);
+    if (first != 1 || second != 2) return Test::Result::failure("stale translation after remapping an inactive address space");
+    Log::printf(Log::Info, "PageTable", "pcid %s\n", pcid_enabled ? "enabled" : "not supported");
+
+    // a shared page is copied on the first write and the remaining owner gets it back writable
+    auto owner = create_address_space();
+    auto sharer = create_address_space();
+    auto page = PhysicalAllocator::alloc(1);
+    if (!page) return Test::Result::failure("could not allocate a page to share");
+    *page->mapTmp().as<volatile uint64_t*>() = 42;
+    constexpr Flags writeableProgram{.writeable = true, .user = true, .writeThrough = false, .cacheDisabled = false};
+    map_range(owner, *page, programPage, page_size, writeableProgram);
+    share_range(owner, programPage, sharer, programPage, page_size, writeableProgram);
+    auto* ownerLeaf = findLeaf(getL4(owner), programPage);
+    auto* sharerLeaf = findLeaf(getL4(sharer), programPage);
+    if (ownerLeaf->writeEnabled || sharerLeaf->writeEnabled) return Test::Result::failure("shared page is still writeable");
+    if (PhysicalAllocator::reference_count(*page) != 2) return Test::Result::failure("shared page is not counted twice");
+    if (!copy_on_write(sharer, programPage)) return Test::Result::failure("write fault on a shared page was not resolved");
+    if (sharerLeaf->address() == *page || *sharerLeaf->address().mapTmp().as<volatile uint64_t*>() != 42) return Test::Result::failure("shared page was not copied");
+    if (!copy_on_write(owner, programPage) || ownerLeaf->address() != *page) return Test::Result::failure("last owner did not keep its page");
+    if (copy_on_write(owner, programPage)) return Test::Result::failure("writeable page was copied again");
+    destroy_address_space(sharer);
+    // a destroyed space drops its references, the remaining owner keeps the page alone
+    auto other = create_address_space();
+    share_range(owner, programPage, other, programPage, page_size, writeableProgram);
+    if (PhysicalAllocator::reference_count(*page) != 2) return Test::Result::failure("shared page is not counted twice");
+    destroy_address_space(other);
+    if (PhysicalAllocator::reference_count(*page) != 1) return Test::Result::failure("destroyed address space kept its reference");
+    destroy_address_space(owner);
+
+    PhysicalAllocator::free(*phys, 2_Mi / page_size);
+    return Test::Result::success();
+}
+
 
 }// namespace PageTable
\ No newline at end of file
@@ -7,8 +7,11 @@
 #include "asm/util.h"
 #include "data/array.h"
 #include "features/lock.h"
+#include "features/math.h"
 #include "file/file.h"
+#include "interrupt/default_handler.h"
 #include "interrupt/interrupt.h"
+#include "memory/arena.h"
 #include "process/scheduler.h"
 
 namespace proc {
@@ -56,9 +59,10 @@ continue_from_here:
 }
 
 static bool has_init = false;
-static execute_context* kernel_context = nullptr;
-static thread** current_thread = nullptr;
-static spinlock lock;
+// syscalls that switch address spaces or change argument memory run one at a time
+static spinlock lock{"process"};
+// children, friends, pending adoptions, parents, adopters, names and methods of all processes
+static rwlock tree_lock{"process tree"};
 extern "C" void syscall();
 asm(R"(
     .text
@@ -69,48 +73,75 @@ syscall:
     iretq
 )");
 
+static thread* current_thread();
+
+static bool resolve_page_fault(VirtualAddress address, uint64_t error) {
+    auto* current = current_thread();
+    if (!current) return false;
+    auto proc = current->get_loaded();
+    if (!proc) return false;
+    bool present = error & (1 << 0);
+    bool write = error & (1 << 1);
+    if (present) {
+        return write && proc->handle_write_fault(address);
+    }
+    return proc->handle_page_fault(address);
+}
+
 static void init() {
     if (has_init) return;
-    kernel_context = new execute_context[APIC::get_core_count()];
-    current_thread = new thread*[APIC::get_core_count()];
     Interrupt::setNativeInterruptHandler(VirtualAddress(syscall), 0x80, 0);
+    Interrupt::set_page_fault_resolver(resolve_page_fault);
     has_init = true;
 }
 
-static execute_context& get_kernel_context() {
-    init();
-    return kernel_context[APIC::get_current_lapic().get_id()];
-}
-
-static thread*& access_current_thread() {
-    init();
-    return current_thread[APIC::get_current_lapic().get_id()];
+// nullptr while no thread runs on this core, the block of the core is nullptr before the cores are known
+static thread* current_thread() {
+    auto* local = APIC::get_cpu_local();
+    return local ? local->current_thread : nullptr;
 }
 
 void switch_to_kernel_stack() {
-    auto& t = access_current_thread();
-    auto& kc = get_kernel_context();
-    enter(kc.stack_ptr, kc.code_ptr, &t->context.stack_ptr, &t->context.code_ptr);
+    auto* local = APIC::get_cpu_local();
+    if (!local || !local->current_thread) panic("switch_to_kernel_stack without a running thread");
+    auto* t = local->current_thread;
+    enter(local->kernel_stack_ptr, local->kernel_code_ptr, &t->context.stack_ptr, &t->context.code_ptr);
 }
 
 void thread::execute() {
-    load();
+    init();
+    auto* local = APIC::get_cpu_local();
+    if (!local) panic("thread::execute called before APIC::init");
+    // the stack was mapped into the owner when the thread was created, so the switch only loads the address space
     get_current()->load();
-    flush_cache();
 
-    auto& kc = get_kernel_context();
-    access_current_thread() = this;
-    enter(context.stack_ptr, context.code_ptr, &kc.stack_ptr, &kc.code_ptr);
+    local->current_thread = this;
+    enter(context.stack_ptr, context.code_ptr, &local->kernel_stack_ptr, &local->kernel_code_ptr);
+    PageTable::switch_address_space(PageTable::kernel_address_space());
 }
 
-void thread::load() {
+shared_ptr<process> thread::get_loaded() const {
+    auto space = PageTable::current_address_space();
+    for (auto* node = working_in.last; node; node = node->prev) {
+        if (node->elem->address_space == space) return node->elem;
+    }
+    auto proc = owner.lock();
+    if (proc && proc->address_space == space) return proc;
+    return nullptr;
+}
+
+void thread::load(process& target) {
     for (auto& region : memory) {
-        for (size_t i = 0; i < region.size; i += page_size) {
-            PageTable::map(region.phys.address + i, region.virt + i, region.flags);
-        }
+        PageTable::map_range(target.address_space, region.phys, region.virt, region.size, region.flags);
+    }
+}
+void thread::unload(process& target) {
+    for (auto& region : memory) {
+        PageTable::unmap_range(target.address_space, region.virt, region.size);
     }
 }
 void thread::on_syscall_disown(syscall::disown_data* data) {
+    lock_guard guard(tree_lock);
     if (data->target.type == syscall::process_descriptor::type_t::SHORT_DESCRIPTOR) {
         Log::error("Process", "Suicide and parricide are prohibited\n");
         return;
@@ -241,6 +272,7 @@ void thread::on_syscall_adopt(syscall::adopt_data* data) {
         Log::error("process", "adopt not successful: cannot adopt self\n");
         return;
     }
+    lock_guard guard(tree_lock);
     auto parent = target->parent.lock();
     while (parent && parent.get() != parent->parent.lock().get()) {
         if (target.get() == parent.get()) {
@@ -265,13 +297,13 @@ void thread::on_syscall_make_friend(syscall::make_friend_data* data) {
         Log::error("process", "make_friend not successful: could not find target\n");
         return;
     }
+    lock_guard guard(tree_lock);
     targetB->friends.push_back(targetA);
 }
 void thread::on_syscall_create_child(syscall::create_child_data* data) {
     auto proc = get_current();
     shared_ptr<process> child = new process();
     child->self = child;
-    child->parent = proc;
     child->main_thread.owner = child;
     child->main_thread.context.code_ptr = data->entry_point;
 
@@ -282,30 +314,60 @@ void thread::on_syscall_create_child(syscall::create_child_data* data) {
             .phys = stack,
             .flags = {.writeable = true, .user = true, .writeThrough = false, .cacheDisabled = false},
             .size = 1_Mi});
+    // mapped once, destroy_address_space frees it with the other pages of the space even if the thread never ran
+    child->main_thread.load(*child);
     child->main_thread.context.stack_ptr = VirtualAddress(32_Ti - 8).address;
 
     // process memory
     for (size_t i = 0; i < data->memory_descriptor_count; ++i) {
         auto& desc = data->memory_descriptors[i];
-        size_t size = desc.size;
-        size += desc.target_virtual_address % page_size;
-        size += page_size - 1;
-        auto phys = PhysicalAllocator::alloc(size / page_size).value_or_panic("out of memory, todo: implement fragmented memory");
-        memset(phys.mapTmp().as<uint8_t*>(), 0, size);
-        memcpy(phys.mapTmp().as<uint8_t*>(), VirtualAddress(desc.source_virtual_address).as<uint8_t*>(), desc.size);
+        PageTable::Flags flags{.writeable = desc.writeable, .user = true, .writeThrough = desc.write_through, .cacheDisabled = desc.cache_disabled};
+        uint64_t source = desc.source_virtual_address;
+        uint64_t target = desc.target_virtual_address;
+        uint64_t start = target & ~(page_size - 1);
+        uint64_t end = (target + desc.size + page_size - 1) & ~(page_size - 1);
+        // the child owns its pages through the page table, pages it never got are zero filled on demand
         child->memory.push_back(memory_area{
-                .virt = VirtualAddress(desc.target_virtual_address),
-                .phys = phys,
-                .flags = {.writeable = desc.writeable, .user = true, .writeThrough = desc.write_through, .cacheDisabled = desc.cache_disabled},
-                .size = size});
+                .virt = VirtualAddress(start),
+                .flags = flags,
+                .size = end - start,
+                .on_demand = true});
+
+        // pages the descriptor covers completely are shared copy on write if source and target have the same offset in a page
+        uint64_t shared_start = end;
+        uint64_t shared_end = end;
+        if (source % page_size == target % page_size) {
+            shared_start = (target + page_size - 1) & ~(page_size - 1);
+            shared_end = (target + desc.size) & ~(page_size - 1);
+            if (shared_end <= shared_start) shared_start = shared_end = end;
+        }
+        for (uint64_t page = shared_start; page < shared_end; page += page_size) {
+            // sharing only sees mapped pages
+            VirtualAddress source_page = page - target + source;
+            if (!PageTable::get(source_page)) proc->handle_page_fault(source_page);
+        }
+        PageTable::share_range(proc->address_space, shared_start - target + source, child->address_space, shared_start, shared_end - shared_start, flags);
+
+        // the partially covered pages are copied, the bytes outside of the descriptor stay zero
+        for (uint64_t page = start; page < end; page += page_size) {
+            if (page >= shared_start && page < shared_end) continue;
+            auto phys = PhysicalAllocator::alloc(1).value_or_panic("out of memory in create_child");
+            auto* buffer = phys.mapTmp().as<uint8_t*>();
+            memset(buffer, 0, page_size);
+            uint64_t copy_start = max(page, target);
+            uint64_t copy_end = min(page + page_size, target + desc.size);
+            memcpy(buffer + (copy_start - page), VirtualAddress(copy_start - target + source).as<uint8_t*>(), copy_end - copy_start);
+            PageTable::map_range(child->address_space, phys, page, page_size, flags);
+        }
     }
-    flush_cache();
-    proc->children.push_back(child);
+    proc->add_child(child);
     scheduler::add_process(child);
 }
 void thread::on_syscall_set_name(syscall::set_name_data* data) {
     size_t len = strlen(data->name);
-    get_current()->name = string::from_char_array(data->name, len);
+    auto name = string::from_char_array(data->name, len);
+    lock_guard guard(tree_lock);
+    get_current()->name = std::move(name);
 }
 void thread::on_syscall_list_processes(syscall::list_processes_data* data) {
     auto proc = get_current()->get_process_by_descriptor(data->target);
@@ -313,7 +375,11 @@ void thread::on_syscall_list_processes(syscall::list_processes_data* data) {
         Log::error("process", "list_processes not successful: could not find target\n");
         return;
     }
-    proc->cleanup_dead();
+    {
+        lock_guard guard(tree_lock);
+        proc->cleanup_dead();
+    }
+    read_guard guard(tree_lock);
     uint8_t* buffer = data->dynamic_allocation_buffer;
     size_t buffer_size = data->dynamic_allocation_buffer_size;
     data->children_total_count = proc->children.size;
@@ -481,21 +547,46 @@ call_indirect_stack_cleanup_done:
 )");
 
 void thread::on_syscall_send_message(syscall::send_message_data* data) {
-    auto proc = get_current()->get_process_by_descriptor(data->target);
+    auto caller = get_current();
+    auto proc = caller->get_process_by_descriptor(data->target);
     if (proc.get() == nullptr) {
         Log::error("process", "send_message not successful: could not find target\n");
         return;
     }
-    if(data->method_id >= proc->methods.size) {
-        Log::error("process", "send_message not successful: method id out of bounds\n");
-        return;
+    // the method is copied so the call does not hold the tree lock, the target may register new methods meanwhile
+    process::method_descriptor method;
+    {
+        read_guard guard(tree_lock);
+        if (data->method_id >= proc->methods.size) {
+            Log::error("process", "send_message not successful: method id out of bounds\n");
+            return;
+        }
+        const auto& registered = proc->methods[data->method_id];
+        method.arguments = registered.arguments;
+        method.argument_count = registered.argument_count;
+        method.expected_argument_count = registered.expected_argument_count;
+        method.call_address = registered.call_address;
+    }
+    // the owner and every process this thread already works in keep its stack until the thread leaves them
+    bool stack_mapped = proc.get() == owner.lock().get();
+    for (auto& working : working_in) {
+        if (working.get() == proc.get()) stack_mapped = true;
     }
     working_in.push_back(proc);
-    auto& method = proc->methods[data->method_id];
 
-    linked_list<VirtualAddress> area_keys;
+    // the call runs with interrupts disabled like the rest of the syscall, so nothing else uses the arena of this cpu meanwhile
+    arena::scope scratch;
+    auto* arguments = arena::allocator::create_array<uint64_t>(data->argument_count);
+    volatile uint64_t argument_count = data->argument_count;
+    memcpy(arguments, data->arguments, argument_count * sizeof(uint64_t));
+
+    linked_list<VirtualAddress, arena::allocator> area_keys;
     auto cleanup = [&](){
         for(auto& key : area_keys) {
+            auto area = proc->method_call_argument_memory.find(key);
+            if (area) {
+                PageTable::unmap_range(proc->address_space, area->virt, area->size);
+            }
             proc->method_call_argument_memory.remove(key);
         }
         working_in.pop_back();
@@ -505,6 +596,7 @@ void thread::on_syscall_send_message(syscall::send_message_data* data) {
         const auto& arg = method.arguments[i];
         size_t size = 0;
         uint64_t ptr = 0;
+        size_t ptr_index = data_arg_index;
         if(arg.type == process::method_descriptor::argument_descriptor::type_t::fixed_length) {
             size = arg.width * arg.length;
             ptr = data->arguments[data_arg_index];
@@ -540,7 +632,7 @@ void thread::on_syscall_send_message(syscall::send_message_data* data) {
                 last_end = start.address + area.size;
 
                 // align to page size
-                last_end = (last_end + page_size - 1) & (page_size - 1);
+                last_end = (last_end + page_size - 1) & ~(page_size - 1);
                 return true;
             });
             if(!found) {
@@ -553,14 +645,20 @@ void thread::on_syscall_send_message(syscall::send_message_data* data) {
             // map to that area (we may need multiple areas as source physical memory is maybe not contiguous)
             optional<memory_area> insert_area;
             for(size_t offset = 0; offset < size; offset += page_size) {
+                // the target may write to the argument, it must not reach other owners of a shared page
+                caller->handle_write_fault(ptr + offset);
                 auto phys = PageTable::get(ptr + offset);
+                if(!phys && caller->handle_page_fault(ptr + offset)) {
+                    // the argument is in a page the caller never touched
+                    phys = PageTable::get(ptr + offset);
+                }
                 if(!phys) {
                     Log::error("process", "send_message not successful: could not find physical memory\n");
                     cleanup();
                     return;
                 }
                 if(insert_area) {
-                    auto current_offset_to_area = ptr + offset - insert_area->virt.address;
+                    auto current_offset_to_area = last_end + offset - insert_area->virt.address;
                     if(insert_area->phys.address + current_offset_to_area == phys.value().address) {
                         insert_area->size += page_size;
                     } else {
@@ -576,22 +674,34 @@ void thread::on_syscall_send_message(syscall::send_message_data* data) {
                 proc->method_call_argument_memory.insert(insert_area->virt, *insert_area);
                 area_keys.push_back(insert_area->virt);
             }
+            // the target only sees the argument at its new place
+            arguments[ptr_index] = last_end + ptr % page_size;
         }
     }
-    auto* arguments = new uint64_t[data->argument_count];
-    volatile uint64_t argument_count = data->argument_count;
-    memcpy(arguments, data->arguments, argument_count * sizeof(uint64_t));
+    for(auto& key : area_keys) {
+        proc->map(proc->method_call_argument_memory.find(key).value());
+    }
 
+    // the call runs on this thread's stack, so it has to be mapped in the target before switching
+    if (!stack_mapped) load(*proc);
     proc->load();
-    data->result = call_indirect(method.call_address.address, arguments, argument_count);
-    delete[] arguments;
+    auto result = call_indirect(method.call_address.address, arguments, argument_count);
     cleanup();
+    get_current()->load();
+    // the target must not keep access to the stack of another process,
+    // its own threads may use the same addresses, their stacks are mapped again
+    if (!stack_mapped) {
+        unload(*proc);
+        proc->main_thread.load(*proc);
+    }
+    // data lives in the address space of the caller
+    data->result = result;
 }
 void thread::on_syscall_ask_abilities(syscall::ask_abilities_data* data) {
     auto proc = get_current()->get_process_by_descriptor(data->target);
     if(data->target.type == syscall::process_descriptor::type_t::SHORT_DESCRIPTOR && data->target.short_descriptor == syscall::process_descriptor::short_descriptor_t::SELF) {
         // register abilities
-        proc->methods.clear();
+        linked_list<process::method_descriptor> methods;
         for(size_t i = 0; i < data->method_count; ++i) {
             auto method = data->methods[i];
             size_t name_length = strlen(method.name);
@@ -608,9 +718,13 @@ void thread::on_syscall_ask_abilities(syscall::ask_abilities_data* data) {
                 }
             }
             result.argument_count = method.argument_count;
+            methods.push_back(std::move(result));
         }
+        lock_guard guard(tree_lock);
+        proc->methods = std::move(methods);
     } else {
         // read abilities from process
+        read_guard guard(tree_lock);
         uint8_t* buffer = data->dynamic_allocation_buffer;
         size_t buffer_size = data->dynamic_allocation_buffer_size;
         data->total_method_count = proc->methods.size;
@@ -653,23 +767,65 @@ void thread::on_syscall_ask_abilities(syscall::ask_abilities_data* data) {
 }
 
 void process::load() {
-    for (auto& region : memory) {
-        for (size_t i = 0; i < region.size; i += page_size) {
-            PageTable::map(region.phys.address + i, region.virt + i, region.flags);
-        }
+    PageTable::switch_address_space(address_space);
+}
+
+void process::map(const memory_area& area) {
+    if (area.on_demand) return;
+    PageTable::map_range(address_space, area.phys, area.virt, area.size, area.flags);
+}
+
+bool process::handle_page_fault(VirtualAddress address) {
+    if (Interrupt::isEnabled()) panic("process::handle_page_fault with interrupts enabled");
+    if (PageTable::current_address_space() != address_space) return false;
+    uint64_t page = address.address & ~(page_size - 1);
+    auto overlaps = [page](const memory_area& area) {
+        return area.on_demand && area.virt.address < page + page_size && area.virt.address + area.size > page;
+    };
+    // segments may share a page, it gets the flags and content of all of them
+    bool found = false;
+    PageTable::Flags flags{.writeable = false, .user = true, .writeThrough = false, .cacheDisabled = false};
+    for (auto& area : memory) {
+        if (!overlaps(area)) continue;
+        found = true;
+        flags.writeable |= area.flags.writeable;
+        flags.writeThrough |= area.flags.writeThrough;
+        flags.cacheDisabled |= area.flags.cacheDisabled;
+    }
+    if (!found) return false;
+    auto phys = PhysicalAllocator::alloc(1);
+    if (!phys) {
+        faults.failed++;
+        return false;
+    }
+    auto* buffer = phys->mapTmp().as<uint8_t*>();
+    memset(buffer, 0, page_size);
+    bool file_backed = false;
+    for (auto& area : memory) {
+        if (!overlaps(area) || !image) continue;
+        uint64_t start = max(page, area.virt.address);
+        uint64_t end = min(page + page_size, area.virt.address + area.file_size);
+        if (start >= end) continue;
+        image->read(buffer + (start - page), area.file_offset + (start - area.virt.address), end - start);
+        file_backed = true;
+    }
+    PageTable::map_range(address_space, *phys, page, page_size, flags);
+    if (file_backed) {
+        faults.file_backed++;
+    } else {
+        faults.zero_fill++;
     }
+    return true;
+}
 
-    method_call_argument_memory.iterate_kv([](auto& key, auto& region) -> bool {
-        for (size_t i = 0; i < region.size; i += page_size) {
-            PageTable::map(region.phys.address + i, region.virt + i, region.flags);
-        }
-        return true;
-    });
+bool process::handle_write_fault(VirtualAddress address) {
+    if (!PageTable::copy_on_write(address_space, address)) return false;
+    faults.copy_on_write++;
+    return true;
 }
 
 extern "C" [[maybe_unused]] void syscall_handler(void* syscallStruct, uint64_t syscallNumber) {
-    lock_guard guard(lock);
-    auto ptr = access_current_thread();
+    auto ptr = current_thread();
     if (ptr == nullptr) {
         Log::fatal("Syscall", "Syscall %d called without active thread\n", syscallNumber);
         return;
@@ -684,18 +840,22 @@ extern "C" [[maybe_unused]] void syscall_handler(void* syscallStruct, uint64_t s
         case 2:
             ptr->on_syscall_make_friend(static_cast<syscall::make_friend_data*>(syscallStruct));
             return;
-        case 3:
+        case 3: {
+            lock_guard guard(lock);
             ptr->on_syscall_create_child(static_cast<syscall::create_child_data*>(syscallStruct));
             return;
+        }
         case 4:
             ptr->on_syscall_set_name(static_cast<syscall::set_name_data*>(syscallStruct));
             return;
         case 5:
             ptr->on_syscall_list_processes(static_cast<syscall::list_processes_data*>(syscallStruct));
             return;
-        case 6:
+        case 6: {
+            lock_guard guard(lock);
             ptr->on_syscall_send_message(static_cast<syscall::send_message_data*>(syscallStruct));
             return;
+        }
         case 7:
             ptr->on_syscall_ask_abilities(static_cast<syscall::ask_abilities_data*>(syscallStruct));
             return;
@@ -711,9 +871,38 @@ extern "C" [[maybe_unused]] void syscall_handler(void* syscallStruct, uint64_t s
 static pid_t next_pid = 0;
 process::process() {
     pid = next_pid++;
+    address_space = PageTable::create_address_space();
 }
 
-static process* find_process(process* self, char* descriptor, bool with_adoption = false) {
+process::~process() {
+    Log::printf(Log::Debug, "Process", "process %i: %i zero fill, %i file backed, %i copy on write and %i failed page faults\n", pid, faults.zero_fill, faults.file_backed, faults.copy_on_write, faults.failed);
+    PageTable::destroy_address_space(address_space);
+}
+
+// the caller holds the process tree lock
+static void print_fault_counters(process& proc) {
+    auto& faults = proc.faults;
+    Log::printf(Log::Info, "Process", "process %i: %i zero fill, %i file backed, %i copy on write and %i failed page faults\n", proc.pid, faults.zero_fill, faults.file_backed, faults.copy_on_write, faults.failed);
+    for (auto& child : proc.children) {
+        print_fault_counters(*child);
+    }
+}
+
+void print_fault_counters() {
+    auto* current = current_thread();
+    if (!current) return;
+    auto proc = current->get_current();
+    if (!proc) return;
+    read_guard guard(tree_lock);
+    // the root is its own parent
+    for (auto parent = proc->parent.lock(); parent && parent.get() != proc.get(); parent = proc->parent.lock()) {
+        proc = parent;
+    }
+    print_fault_counters(*proc);
+}
+
+// returns the references of the tree itself, a process may not be wrapped into a second shared_ptr
+static shared_ptr<process> find_process(process* self, char* descriptor, bool with_adoption = false) {
     auto len = strlen(descriptor);
     if (len >= sizeof("child") && memcmp(descriptor, "child", sizeof("child") - 1) == 0) {
         if (descriptor[sizeof("child")] != ':') return nullptr;
@@ -723,7 +912,7 @@ static process* find_process(process* self, char* descriptor, bool with_adoption
 
         for (auto& child : self->children) {
             if (child->name.length == size && memcmp(child->name.data, descriptor, size) == 0) {
-                if (descriptor[size] == '\0') return child.get();
+                if (descriptor[size] == '\0') return child;
                 return find_process(child.get(), descriptor + size + 1);
             }
         }
@@ -738,7 +927,7 @@ static process* find_process(process* self, char* descriptor, bool with_adoption
         for (auto& friend_ptr : self->friends) {
             auto friend_ = friend_ptr.lock();
             if (friend_->name.length == size && memcmp(friend_->name.data, descriptor, size) == 0) {
-                if (descriptor[size] == '\0') return friend_.get();
+                if (descriptor[size] == '\0') return friend_;
                 return find_process(friend_.get(), descriptor + size + 1);
             }
         }
@@ -754,7 +943,7 @@ static process* find_process(process* self, char* descriptor, bool with_adoption
         for (auto& adoption_ptr : self->pending_adoption) {
             auto adoption = adoption_ptr.lock();
             if (adoption->name.length == size && memcmp(adoption->name.data, descriptor, size) == 0) {
-                if (descriptor[size] == '\0') return adoption.get();
+                if (descriptor[size] == '\0') return adoption;
                 return nullptr;
             }
         }
@@ -764,6 +953,12 @@ static process* find_process(process* self, char* descriptor, bool with_adoption
 }
 
 shared_ptr<process> process::get_process_by_descriptor(const syscall::process_descriptor& descriptor, bool with_adoption) {
+    read_guard guard(tree_lock);
+    return find_by_descriptor(descriptor, with_adoption);
+}
+
+// the caller holds the tree lock, readers may not take it again
+shared_ptr<process> process::find_by_descriptor(const syscall::process_descriptor& descriptor, bool with_adoption) {
     switch (descriptor.type) {
         case syscall::process_descriptor::type_t::SHORT_DESCRIPTOR:
             switch (descriptor.short_descriptor) {
@@ -775,23 +970,23 @@ shared_ptr<process> process::get_process_by_descriptor(const syscall::process_de
                     return nullptr;
             }
         case syscall::process_descriptor::type_t::NUMBER: {
-            if (pid == descriptor.number) return this;
-            if (auto ptr = parent.lock(); ptr && ptr->pid == descriptor.number) return ptr.get();
+            if (pid == descriptor.number) return self.lock();
+            if (auto ptr = parent.lock(); ptr && ptr->pid == descriptor.number) return ptr;
             for (auto& child : children) {
-                if (child->pid == descriptor.number) return child.get();
+                if (child->pid == descriptor.number) return child;
             }
             for (auto& friend_ptr : friends) {
-                if (auto ptr = friend_ptr.lock(); ptr && ptr->pid == descriptor.number) return ptr.get();
+                if (auto ptr = friend_ptr.lock(); ptr && ptr->pid == descriptor.number) return ptr;
             }
             for (auto& pending : pending_adoption) {
-                if (auto ptr = pending.lock(); ptr && ptr->pid == descriptor.number) return ptr.get();
+                if (auto ptr = pending.lock(); ptr && ptr->pid == descriptor.number) return ptr;
             }
             for (auto& child : children) {
-                if (auto res = child->get_process_by_descriptor(descriptor, with_adoption)) return res;
+                if (auto res = child->find_by_descriptor(descriptor, with_adoption)) return res;
             }
             for (auto& friend_ptr : friends) {
                 if (auto ptr = friend_ptr.lock()) {
-                    if (auto res = ptr->get_process_by_descriptor(descriptor, with_adoption)) return res;
+                    if (auto res = ptr->find_by_descriptor(descriptor, with_adoption)) return res;
                 }
             }
             return nullptr;
@@ -808,7 +1003,7 @@ void process::handle_disown() {
         shared_ptr<process> self;
         for (const auto& tmp : ptr->pending_adoption) {
             if (auto self_tmp = tmp.lock(); self_tmp.get() == this) {
-                self = self_tmp;
+                self = std::move(self_tmp);
                 break;
             }
             adoption_index++;
@@ -817,7 +1012,7 @@ void process::handle_disown() {
             Log::warning("process", "Process wanted to be adopted by someone that doesnt want to adopt that process\n");
         } else {
             ptr->pending_adoption.remove(adoption_index);
-            ptr->children.push_back(self);
+            ptr->children.push_back(std::move(self));
         }
     }
 }
@@ -864,10 +1059,17 @@ void process::add_kernel_method_by_array(const string& name, VirtualAddress call
             }
         }
     }
+    lock_guard guard(tree_lock);
     methods.push_back(descriptor);
 }
 
-shared_ptr<process> from_elf(file::file& file) {
+void process::add_child(shared_ptr<process> child) {
+    lock_guard guard(tree_lock);
+    child->parent = self;
+    children.push_back(std::move(child));
+}
+
+shared_ptr<process> from_elf(intrusive_ptr<file::file> file) {
     auto upper_bound = 16_Ti;
 
     struct header {
@@ -893,7 +1095,7 @@ shared_ptr<process> from_elf(file::file& file) {
     };
     static_assert(sizeof(header) == 64);
     header file_header{};
-    file.read(&file_header, 0, sizeof(file_header));
+    file->read(&file_header, 0, sizeof(file_header));
     // check magic
     if (file_header.magic[0] != 0x7f || file_header.magic[1] != 'E' || file_header.magic[2] != 'L' || file_header.magic[3] != 'F') {
         return nullptr;
@@ -915,30 +1117,22 @@ shared_ptr<process> from_elf(file::file& file) {
     static_assert(sizeof(program_header) == 56);
 
     shared_ptr<process> proc(new process());
+    proc->image = file;
     array<program_header> headers(file_header.program_header_entry_count, file_header.program_header_offset);
-    file.read(headers.data(), file_header.program_header_offset, file_header.program_header_entry_count * file_header.program_header_offset);
+    file->read(headers.data(), file_header.program_header_offset, file_header.program_header_entry_count * file_header.program_header_offset);
     for (auto& header : headers) {
         if (header.type == 1) {
-            // allocate physical memory
             if (header.virtual_address + header.memory_size > upper_bound) {
                 panic("program too big");
             }
-            auto page_count = (header.memory_size + page_size - 1) / page_size;
-            auto phys = PhysicalAllocator::alloc(page_count).value_or_panic("out of memory, todo: implement fragmented program headers");
+            // nothing is allocated or read here, the pages are filled by handle_page_fault on first access
             proc->memory.push_back(memory_area{
                     .virt = VirtualAddress(header.virtual_address),
-                    .phys = phys,
                     .flags = {.writeable = true, .user = true, .writeThrough = false, .cacheDisabled = false},
-                    .size = header.memory_size});
-        }
-    }
-    proc->load();
-    flush_cache();
-    for (auto& header : headers) {
-        if (header.type == 1) {
-            memset(VirtualAddress(header.virtual_address), 0, header.memory_size);
-            // copy data
-            file.read(VirtualAddress(header.virtual_address), header.file_offset, header.file_size);
+                    .size = header.memory_size,
+                    .on_demand = true,
+                    .file_offset = header.file_offset,
+                    .file_size = header.file_size});
         }
     }
 
@@ -949,12 +1143,13 @@ shared_ptr<process> from_elf(file::file& file) {
             .phys = stack,
             .flags = {.writeable = true, .user = true, .writeThrough = false, .cacheDisabled = false},
             .size = 1_Mi});
+    // mapped once, destroy_address_space frees it with the other pages of the space even if the thread never ran
+    proc->main_thread.load(*proc);
 
     proc->main_thread.context.stack_ptr = VirtualAddress(upper_bound - 16).address;
     proc->main_thread.context.code_ptr = file_header.entry_point;
     proc->self = proc;
     proc->main_thread.owner = proc;
-    flush_cache();
     return proc;
 }
 
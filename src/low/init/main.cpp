@@ -188,7 +188,7 @@ static void map_high_kernel_to_high_memory() {
         page_2mib.accessed = 0;
         page_2mib.dirty = 0;
         page_2mib.largePage = 1;
-        page_2mib.global = 0;
+        page_2mib.global = 1;
         page_2mib.available = 0;
         asm("invlpg (%0)"
             :
@@ -35,7 +35,7 @@ trampoline_entry_32:
     mov %eax, %cr3
 
     mov %cr4, %eax
-    or $(0x1 << 5), %eax
+    or $((0x1 << 5) | (0x1 << 7)), %eax
     mov %eax, %cr4
 
     mov $0xC0000080, %ecx